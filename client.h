@@ -97,6 +97,7 @@ void IClient::displayTitle() const
     std::cout << " FOLLOW <username>\n";
     std::cout << " UNFOLLOW <username>\n";
     std::cout << " LIST\n";
+    std::cout << " SEARCH <keywords>\n";
     std::cout << " TIMELINE\n";
     std::cout << "=====================================\n";
 }
@@ -0,0 +1,164 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <google/protobuf/message.h>
+
+/*
+ * Binary trace of the RPCs received by tsd, written when tsd is started with -R and
+ * replayed by tsreplay.
+ *
+ * A trace is a sequence of records. Each record is a TraceHeader followed by the request
+ * message serialized as protobuf. Records are written as RPCs complete, so tsreplay sorts
+ * them by arrival time before replaying.
+ *
+ * - session: one per client connection, so calls from the same client replay in order
+ * - stream: one per ProcessTimeline call, zero for unary calls
+ * - time_us: when the request arrived, in microseconds since the trace started
+ * - latency_us: how long tsd took to handle a unary call
+ */
+
+enum TraceType
+{
+    TRACE_ADD_USER = 1,
+    TRACE_LIST_USERS,
+    TRACE_FOLLOW_USER,
+    TRACE_UNFOLLOW_USER,
+    TRACE_LOOKUP_USERS,
+    TRACE_BULK_ADD_USERS,
+    TRACE_BULK_FOLLOW,
+    TRACE_TIMELINE_POST,
+    TRACE_SEARCH_POSTS,
+    TRACE_WHO_TO_FOLLOW,
+    TRACE_TOP_USERS
+};
+
+#pragma pack(push, 1)
+struct TraceHeader
+{
+    uint8_t type;
+    uint32_t session;
+    uint64_t stream;
+    uint64_t time_us;
+    uint32_t latency_us;
+    uint32_t size;
+};
+#pragma pack(pop)
+
+// A record read back from a trace
+struct TraceRecord
+{
+    TraceHeader header;
+    std::string message;
+};
+
+// Names of the traced RPCs, indexed by TraceType
+static const char* const TRACE_NAMES[] = {
+    "", "AddUser", "ListUsers", "FollowUser", "UnfollowUser", "LookupUsers",
+    "BulkAddUsers", "BulkFollow", "TimelinePost", "SearchPosts", "WhoToFollow", "TopUsers"
+};
+#define TRACE_TYPES 12
+
+// Call metadata through which clients identify their process, so that calls are grouped into sessions by
+// client rather than by connection. Clients on a Unix domain socket or in the same process share one peer address
+#define TRACE_SESSION_KEY "ts-session"
+
+// Appends records to a trace file. Recording is a no-op until open() succeeds
+class TraceWriter
+{
+    public:
+        TraceWriter() : enabled(false), next_stream(1) {}
+
+        bool open(const std::string& path)
+        {
+            out.open(path, std::ios_base::binary | std::ios_base::trunc);
+            enabled = (bool) out;
+            start = last_flush = std::chrono::steady_clock::now();
+            return enabled;
+        }
+
+        bool isEnabled() const { return enabled; }
+
+        // Returns the session number for a client, given the ID it sent as TRACE_SESSION_KEY or else its peer address
+        uint32_t session(const std::string& client)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto pos = sessions.find(client);
+            if (pos != end(sessions))
+                return pos->second;
+            uint32_t id = sessions.size() + 1;
+            sessions[client] = id;
+            return id;
+        }
+
+        // Returns a new stream number for a timeline
+        uint64_t stream()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return next_stream++;
+        }
+
+        void record(TraceType type, uint32_t session, uint64_t stream,
+                    std::chrono::steady_clock::time_point arrival, uint32_t latency_us,
+                    const google::protobuf::Message& message)
+        {
+            if (!enabled)
+                return;
+
+            std::string bytes;
+            message.SerializeToString(&bytes);
+
+            TraceHeader header;
+            header.type = type;
+            header.session = session;
+            header.stream = stream;
+            header.latency_us = latency_us;
+            header.size = bytes.size();
+
+            std::lock_guard<std::mutex> lock(mtx);
+            header.time_us = std::chrono::duration_cast<std::chrono::microseconds>(arrival - start).count();
+            out.write((const char*) &header, sizeof(header));
+            out.write(bytes.data(), bytes.size());
+
+            // Flush about once a second so little is lost when the server is killed
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_flush > std::chrono::seconds(1)) {
+                out.flush();
+                last_flush = now;
+            }
+        }
+
+    private:
+        bool enabled;
+        uint64_t next_stream;
+        std::mutex mtx;
+        std::ofstream out;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point last_flush;
+        std::unordered_map<std::string, uint32_t> sessions;
+};
+
+// Reads every record of a trace, returning false if the file cannot be opened
+inline bool readTrace(const std::string& path, std::vector<TraceRecord>& records)
+{
+    std::ifstream in(path, std::ios_base::binary);
+    if (!in)
+        return false;
+
+    TraceRecord record;
+    while (in.read((char*) &record.header, sizeof(record.header))) {
+        record.message.resize(record.header.size);
+        if (!in.read(&record.message[0], record.header.size))
+            break;
+        records.push_back(record);
+    }
+    return true;
+}
+
+#endif
@@ -2,10 +2,12 @@
 #include <unistd.h>
 #include <thread>
 #include <algorithm>
+#include <unordered_map>
 #include <grpc++/grpc++.h>
 #include "client.h"
 
 #include "ts.grpc.pb.h"
+#include "trace.h"
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -19,8 +21,15 @@ class Client : public IClient
     public:
 	    Client(const std::string& hname,
                const std::string& uname,
-               const std::string& p)
-	    :hostname(hname), username(uname), port(p) {}
+               const std::string& p,
+               const std::string& s)
+	    :hostname(hname), username(uname), port(p), socket_path(s), user_id(0),
+	     epoch(0), users_generation(0), followers_generation(0) {
+	    	// Identify this process to the server, so traces keep its calls together whatever the transport
+	    	char host[256] = "";
+	    	gethostname(host, sizeof(host) - 1);
+	    	session_id = std::string(host) + "-" + std::to_string(getpid()) + "-" + std::to_string(time(NULL));
+	    }
 	
     protected:
         virtual int connectTo();
@@ -32,18 +41,51 @@ class Client : public IClient
         std::string username;
         std::string port;
         
+        // Unix domain socket to connect through instead of TCP, for clients on the server's host
+        std::string socket_path;
+        
+        // ID the server assigned to us, used in place of our username in requests
+        int user_id;
+        
+        // ID sent with every call so the server can tell this client apart from others on the same connection address
+        std::string session_id;
+        
+        // Usernames of other users by ID (and the reverse), filled in lazily from the server
+        std::unordered_map<int, std::string> user_names;
+        std::unordered_map<std::string, int> user_ids;
+        std::string lookupName(int id);
+        
+        // Results of the last LIST, along with the generations the server reported for them
+        int64_t epoch;
+        int64_t users_generation;
+        int64_t followers_generation;
+        std::vector<std::string> cached_users;
+        std::vector<std::string> cached_followers;
+        
         // You can have an instance of the client stub
         // as a member variable.
     	std::unique_ptr<TSN::Stub> stub_;
 };
 
+// Splits a newline separated list of usernames from the server
+std::vector<std::string> splitLines(const std::string& str)
+{
+	std::vector<std::string> lines;
+	std::stringstream ss(str);
+	std::string line;
+	while (std::getline(ss, line, '\n'))
+		lines.push_back(line);
+	return lines;
+}
+
 int main(int argc, char** argv) {
 
     std::string hostname = "localhost";
     std::string username = "default";
     std::string port = "3010";
+    std::string socket_path;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "h:u:p:")) != -1){
+    while ((opt = getopt(argc, argv, "h:u:p:s:")) != -1){
         switch(opt) {
         case 'h':
         	hostname = optarg;
@@ -54,12 +96,15 @@ int main(int argc, char** argv) {
         case 'p':
             port = optarg;
 		break;
+        case 's':
+            socket_path = optarg;
+		break;
         default:
             std::cerr << "Invalid Command Line Argument\n";
         }
     }
 
-    Client myc(hostname, username, port);
+    Client myc(hostname, username, port, socket_path);
 
     // You MUST invoke "run_client" function to start business logic
     myc.run_client();
@@ -70,9 +115,10 @@ int main(int argc, char** argv) {
 // This function establishes a connection to the server
 int Client::connectTo()
 {
-    // Create a client stub
+    // Create a client stub, connecting through the Unix domain socket if one was given
+    std::string target = socket_path.empty() ? hostname + ":" + port : "unix:" + socket_path;
     stub_ = TSN::NewStub(std::shared_ptr<Channel>(
-    					 grpc::CreateChannel(hostname + ":" + port, 
+    					 grpc::CreateChannel(target, 
     					 grpc::InsecureChannelCredentials())));
     
     // Initialize the request to send to the server
@@ -84,13 +130,18 @@ int Client::connectTo()
 
     // Context for the client.
     ClientContext context;
+    context.AddMetadata(TRACE_SESSION_KEY, session_id);
 
     // The actual RPC.
     Status status = stub_->AddUser(&context, request, &reply);
 
     // Act upon its status.
-    if (status.ok() && (IStatus) reply.status() == IStatus::SUCCESS)
+    if (status.ok() && (IStatus) reply.status() == IStatus::SUCCESS) {
+    	user_id = reply.user_id();
+    	user_names[user_id] = username;
+    	user_ids[username] = user_id;
       	return 1;
+    }
 	else
       	return -1;
 }
@@ -102,6 +153,7 @@ IReply Client::processCommand(std::string& input)
 	IReply ire;
 	
 	ClientContext context;
+	context.AddMetadata(TRACE_SESSION_KEY, session_id);
 	Status status;
 	
 	// Parse the first word of the command from the user
@@ -114,15 +166,20 @@ IReply Client::processCommand(std::string& input)
     	// Initialize the request and reply objects
     	FollowUserRequest request;
     	UserReply reply;		
-		request.set_username(username);
+		request.set_user_id(user_id);
 		
-		// Get the user to follow
+		// Get the user to follow, sending their ID instead if we know it
     	std::string userToFollow;
     	ss >> userToFollow;
-    	request.set_user_to_follow(userToFollow);
+    	auto id = user_ids.find(userToFollow);
+    	if (id != end(user_ids))
+    		request.set_user_to_follow_id(id->second);
+    	else
+    		request.set_user_to_follow(userToFollow);
     		
     	// Perform the RPC and get the result
     	status = stub_->FollowUser(&context, request, &reply);
+    	ire.grpc_status = status;
     	if (status.ok()) {
     		ire.comm_status = (IStatus) reply.status();
     	}
@@ -135,15 +192,20 @@ IReply Client::processCommand(std::string& input)
     	// Initialize the request and reply objects
     	UnfollowUserRequest request;
     	UserReply reply;
-    	request.set_username(username);	
+    	request.set_user_id(user_id);	
     	
-    	// Get the user to unfollow
+    	// Get the user to unfollow, sending their ID instead if we know it
     	std::string userToUnfollow;
     	ss >> userToUnfollow;
-    	request.set_user_to_unfollow(userToUnfollow);
+    	auto id = user_ids.find(userToUnfollow);
+    	if (id != end(user_ids))
+    		request.set_user_to_unfollow_id(id->second);
+    	else
+    		request.set_user_to_unfollow(userToUnfollow);
     	
     	// Perform the RPC and get the result
     	status = stub_->UnfollowUser(&context, request, &reply);
+    	ire.grpc_status = status;
     	if (status.ok()) {
     		ire.comm_status = (IStatus) reply.status();
     	}
@@ -152,13 +214,17 @@ IReply Client::processCommand(std::string& input)
     	}    	    
     }
     else if (command == "LIST") {
-    	// Initialize the request and reply objects
-		UserRequest request;
+    	// Initialize the request and reply objects, passing along the generations we have cached
+		ListUsersRequest request;
 		ListUsersReply reply;
-		request.set_username(username);
+		request.set_user_id(user_id);
+		request.set_epoch(epoch);
+		request.set_users_generation(users_generation);
+		request.set_followers_generation(followers_generation);
 		
 		// Perform the RPC and get the result
     	status = stub_->ListUsers(&context, request, &reply);
+    	ire.grpc_status = status;
     	if (status.ok()) {
     		ire.comm_status = (IStatus) reply.status();
     	}
@@ -166,25 +232,50 @@ IReply Client::processCommand(std::string& input)
     		ire.comm_status = FAILURE_UNKNOWN;
     	}
     	
-    	// Populate the IReply object with the response strings from the RPC
-    	std::stringstream all_users(reply.all_users());
-    	std::string user;
-    	
-    	if (reply.all_users() != "") {
-    		while (std::getline(all_users, user, '\n')) {
-    			ire.all_users.push_back(user);
-    		}
+    	if (status.ok() && reply.status() == SUCCESS) {
+	    	// Apply the changes to our cached lists, or replace them if the server sent everything
+	    	if (!reply.users_delta())
+	    		cached_users.clear();
+	    	for (std::string& user : splitLines(reply.all_users()))
+	    		cached_users.push_back(user);
+	    	
+	    	if (!reply.followers_delta())
+	    		cached_followers.clear();
+	    	for (std::string& user : splitLines(reply.removed_followers()))
+	    		cached_followers.erase(std::remove(begin(cached_followers), end(cached_followers), user), end(cached_followers));
+	    	for (std::string& user : splitLines(reply.followers()))
+	    		cached_followers.push_back(user);
+	    	
+	    	epoch = reply.epoch();
+	    	users_generation = reply.users_generation();
+	    	followers_generation = reply.followers_generation();
+	    	
+	    	// Populate the IReply object with the cached lists
+	    	ire.all_users = cached_users;
 	    	std::sort(begin(ire.all_users), end(ire.all_users));
+	    	ire.followers = cached_followers;
+	    	std::sort(begin(ire.followers), end(ire.followers));
     	}
+    }
+    // If the command was 'SEARCH <KEYWORDS>'
+    else if (command == "SEARCH") {
+    	// Initialize the request with the rest of the line as the query
+    	SearchRequest request;
+    	request.set_user_id(user_id);
+    	std::string query;
+    	std::getline(ss, query);
+    	request.set_query(query);
     	
-    	std::stringstream followers(reply.followers());
-    	
-    	if (reply.followers() != "") {
-    		while (std::getline(followers, user, '\n')) {
-    			ire.followers.push_back(user);
-    		}
-    		std::sort(begin(ire.followers), end(ire.followers));
+    	// Stream the matching posts back, printing each as it arrives
+    	std::unique_ptr<ClientReader<PostMessage>> reader(stub_->SearchPosts(&context, request));
+    	PostMessage p;
+    	while (reader->Read(&p)) {
+    		time_t time = p.time();
+    		displayPostMessage(lookupName(p.sender_id()), p.content(), time);
     	}
+    	status = reader->Finish();
+    	ire.grpc_status = status;
+    	ire.comm_status = status.ok() ? SUCCESS : FAILURE_UNKNOWN;
     }
     // If the command was 'TIMELINE'
     else if (command == "TIMELINE") {
@@ -204,35 +295,36 @@ void Client::processTimeline()
 {
 	// Create the client context and begin the bidirectional RPC stream
     ClientContext context;
+    context.AddMetadata(TRACE_SESSION_KEY, session_id);
     std::shared_ptr<ClientReaderWriter<PostMessage, PostMessage>> stream(stub_->ProcessTimeline(&context));
     
     // Create an initial message to send to the server containing the current user's username
     PostMessage userinfo;
     userinfo.set_content("");
     userinfo.set_time((long int) time(NULL));
-    userinfo.set_sender(username);
+    userinfo.set_sender_id(user_id);
     stream->Write(userinfo);
     	
  	// This thread constantly prompts the user for input and streams it to the server
-   	std::thread writer{[stream](std::string username) {
+   	std::thread writer{[stream](int user_id) {
         std::string msg;
        	while (1) {
        	    PostMessage p;
        	    p.set_content(getPostMessage());
        	    p.set_time((long int) time(NULL));
-       	    p.set_sender(username);
+       	    p.set_sender_id(user_id);
        	    stream->Write(p);
        	}
        	stream->WritesDone();
-    }, username};
+    }, user_id};
 
 	// This thread reads timeline updates from the server and prints them to standard output
-   	std::thread reader([stream]() {
+   	std::thread reader([this, stream]() {
        	PostMessage p;
        	time_t time; 
        	while(stream->Read(&p)){
        	  	time = p.time();
-       	    displayPostMessage(p.sender(), p.content(), time); 
+       	    displayPostMessage(lookupName(p.sender_id()), p.content(), time); 
        	}
    	});
 
@@ -240,3 +332,25 @@ void Client::processTimeline()
    	writer.join();
    	reader.join();
 }
+
+// This function returns the username for a user ID, asking the server the first time an ID is seen
+std::string Client::lookupName(int id)
+{
+	auto name = user_names.find(id);
+	if (name != end(user_names))
+		return name->second;
+	
+	LookupUsersRequest request;
+	LookupUsersReply reply;
+	ClientContext context;
+	context.AddMetadata(TRACE_SESSION_KEY, session_id);
+	request.add_user_ids(id);
+	
+	Status status = stub_->LookupUsers(&context, request, &reply);
+	if (!status.ok() || reply.usernames_size() == 0 || reply.usernames(0) == "")
+		return "unknown";
+	
+	user_names[id] = reply.usernames(0);
+	user_ids[reply.usernames(0)] = id;
+	return reply.usernames(0);
+}
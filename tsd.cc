@@ -2,14 +2,28 @@
 #include <thread>
 #include <string>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <regex>
 #include <fstream>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
 #include <semaphore.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <grpc++/grpc++.h>
 
 #include "ts.grpc.pb.h"
+#include "trace.h"
+#include "tsd.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -18,24 +32,380 @@ using grpc::ServerReader;
 using grpc::ServerReaderWriter;
 using grpc::ServerWriter;
 using grpc::Status;
+using grpc::StatusCode;
 
-// Struct to represent a post to a timeline, consisting of a post time, the username of the poster, and the contents
+// Token bucket for a single user, refilled over time by its RateLimiter
+struct TokenBucket {
+	double tokens;
+	std::chrono::steady_clock::time_point last;
+	TokenBucket(double _tokens) : tokens(_tokens), last(std::chrono::steady_clock::now()) {}
+};
+
+// Limits how often each user may perform an action, allowing short bursts up to the bucket size
+class RateLimiter {
+	public:
+		RateLimiter(double _rate, double _burst) : rate(_rate), burst(std::max(1.0, _burst)) {}
+		bool allow(int user_id);
+		
+	private:
+		double rate;
+		double burst;
+		std::mutex mtx;
+		std::unordered_map<int, TokenBucket> buckets;
+};
+
+// Takes a token from the user's bucket, returning false if they have exceeded their rate
+bool RateLimiter::allow(int user_id) {
+	if (rate <= 0)
+		return true;
+	
+	std::lock_guard<std::mutex> lock(mtx);
+	auto bucket = buckets.find(user_id);
+	if (bucket == end(buckets))
+		bucket = buckets.emplace(user_id, TokenBucket(burst)).first;
+	
+	// Refill the bucket for the time elapsed since it was last used
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed = now - bucket->second.last;
+	bucket->second.tokens = std::min(burst, bucket->second.tokens + elapsed.count() * rate);
+	bucket->second.last = now;
+	
+	if (bucket->second.tokens < 1)
+		return false;
+	bucket->second.tokens -= 1;
+	return true;
+}
+
+// Request priorities used when shedding load. Lower priority requests are turned away first
+enum Priority {
+	PRIORITY_LOW,       // Listing users
+	PRIORITY_NORMAL,    // Following and unfollowing
+	PRIORITY_HIGH       // Logging in
+};
+
+// Tracks the number of unary requests in progress and rejects new ones early once the server is busy.
+// Low priority requests are shed at half the limit, normal at three quarters, and high at the limit itself
+class AdmissionControl {
+	public:
+		AdmissionControl(int _max_in_flight) : max_in_flight(_max_in_flight), in_flight(0) {}
+		bool admit(Priority priority);
+		void release() { in_flight--; }
+		
+	private:
+		int max_in_flight;
+		std::atomic<int> in_flight;
+};
+
+bool AdmissionControl::admit(Priority priority) {
+	int limit = std::max(1, max_in_flight * (priority + 2) / 4);
+	if (in_flight++ >= limit && max_in_flight > 0) {
+		in_flight--;
+		return false;
+	}
+	return true;
+}
+
+// Holds a slot in the admission control for the lifetime of a request
+class Admission {
+	public:
+		Admission(AdmissionControl& _control, Priority priority) : control(_control), admitted(_control.admit(priority)) {}
+		~Admission() { if (admitted) control.release(); }
+		bool ok() const { return admitted; }
+		
+	private:
+		AdmissionControl& control;
+		bool admitted;
+};
+
+// Identifies the client a call came from for the trace, by the session ID it sent or else by its connection
+static std::string clientSession(ServerContext* context) {
+	auto session = context->client_metadata().find(TRACE_SESSION_KEY);
+	if (session != end(context->client_metadata()))
+		return "session:" + std::string(session->second.data(), session->second.length());
+	return context->peer();
+}
+
+// Records a unary call in the trace once it completes, along with how long it took
+class TraceScope {
+	public:
+		TraceScope(TraceWriter& _tracer, TraceType _type, ServerContext* context, const google::protobuf::Message& _request)
+			: tracer(_tracer), type(_type), request(_request), arrival(std::chrono::steady_clock::now()),
+			  session(_tracer.isEnabled() ? _tracer.session(clientSession(context)) : 0) {}
+		~TraceScope() {
+			if (!tracer.isEnabled())
+				return;
+			auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - arrival);
+			tracer.record(type, session, 0, arrival, latency.count(), request);
+		}
+		
+	private:
+		TraceWriter& tracer;
+		TraceType type;
+		const google::protobuf::Message& request;
+		std::chrono::steady_clock::time_point arrival;
+		uint32_t session;
+};
+
+// Status returned to clients whose requests are shed or rate limited
+static Status overloaded(const std::string& reason) {
+	return Status(StatusCode::RESOURCE_EXHAUSTED, reason);
+}
+
+// Struct to represent a post to a timeline, consisting of a post time, the ID of the poster, and the contents
 struct Post {
 	time_t time;
-	std::string poster;
+	int poster;
 	std::string text;
-	Post(time_t _time, std::string _poster, std::string _text) : time(_time), poster(_poster), text(_text) {}
+	Post(time_t _time, int _poster, std::string _text) : time(_time), poster(_poster), text(_text) {}
+};
+
+// In-memory inverted index over the contents of every post. Posts are numbered in the order they
+// are indexed, so higher numbers are newer. Each term's posting list holds the increasing numbers
+// of the posts containing it, stored as varint-encoded gaps to keep the lists small
+class PostIndex {
+	public:
+		void add(const Post& post);
+		std::vector<Post> search(const std::string& query, const std::unordered_set<int>& posters, int limit) const;
+		static std::vector<std::string> tokenize(const std::string& text);
+		
+	private:
+		struct PostingList {
+			std::string bytes;
+			int last = -1;
+			int count = 0;
+		};
+		std::vector<int> decode(const PostingList& list) const;
+		
+		std::vector<Post> posts;
+		std::unordered_map<std::string, PostingList> terms;
+		mutable std::mutex mtx;
+};
+
+// Splits text into lowercase alphanumeric terms
+std::vector<std::string> PostIndex::tokenize(const std::string& text) {
+	std::vector<std::string> tokens;
+	std::string token;
+	for (char c : text + " ") {
+		if (isalnum((unsigned char) c)) {
+			token += tolower((unsigned char) c);
+		}
+		else if (!token.empty()) {
+			tokens.push_back(token);
+			token.clear();
+		}
+	}
+	return tokens;
+}
+
+void PostIndex::add(const Post& post) {
+	std::lock_guard<std::mutex> lock(mtx);
+	int id = posts.size();
+	posts.push_back(post);
+	
+	for (const std::string& term : tokenize(post.text)) {
+		PostingList& list = terms[term];
+		if (list.last == id)
+			continue;
+		
+		// Append the gap from the previous post as a varint, seven bits at a time
+		unsigned int gap = id - list.last;
+		while (gap >= 0x80) {
+			list.bytes += (char) (gap | 0x80);
+			gap >>= 7;
+		}
+		list.bytes += (char) gap;
+		list.last = id;
+		list.count++;
+	}
+}
+
+std::vector<int> PostIndex::decode(const PostingList& list) const {
+	std::vector<int> ids;
+	ids.reserve(list.count);
+	int id = -1;
+	unsigned int gap = 0;
+	int shift = 0;
+	for (char c : list.bytes) {
+		gap |= (unsigned int) (c & 0x7f) << shift;
+		shift += 7;
+		if (!(c & 0x80)) {
+			id += gap;
+			ids.push_back(id);
+			gap = 0;
+			shift = 0;
+		}
+	}
+	return ids;
+}
+
+// Returns up to limit posts, newest first, that contain every term of the query and were made by one of the given posters
+std::vector<Post> PostIndex::search(const std::string& query, const std::unordered_set<int>& posters, int limit) const {
+	std::vector<Post> results;
+	std::vector<std::string> query_terms = tokenize(query);
+	if (query_terms.empty())
+		return results;
+	
+	std::lock_guard<std::mutex> lock(mtx);
+	
+	// Intersect the posting lists, starting from the shortest
+	std::vector<const PostingList*> lists;
+	for (const std::string& term : query_terms) {
+		auto list = terms.find(term);
+		if (list == end(terms))
+			return results;
+		lists.push_back(&list->second);
+	}
+	std::sort(begin(lists), end(lists), [](const PostingList* a, const PostingList* b) { return a->count < b->count; });
+	
+	std::vector<int> matches = decode(*lists[0]);
+	for (size_t i = 1; i < lists.size() && !matches.empty(); i++) {
+		std::vector<int> ids = decode(*lists[i]);
+		std::vector<int> both;
+		std::set_intersection(begin(matches), end(matches), begin(ids), end(ids), std::back_inserter(both));
+		matches.swap(both);
+	}
+	
+	for (auto id = matches.rbegin(); id != matches.rend() && (int) results.size() < limit; ++id) {
+		const Post& post = posts[*id];
+		if (posters.count(post.poster))
+			results.push_back(post);
+	}
+	return results;
+}
+
+// Runs work(begin, end) over the range [0, count), split evenly across threads
+template <typename F>
+static void parallelFor(int count, int threads, F work) {
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) {
+		int begin = (long) count * t / threads;
+		int end = (long) count * (t + 1) / threads;
+		workers.push_back(std::thread(work, begin, end));
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+// Number of users kept in the top users list, and of recommendations kept for each user
+#define TOP_USERS_SIZE 100
+#define RECOMMENDATIONS_SIZE 10
+
+// Immutable snapshot of the follow graph in compressed sparse row form, along with the analytics computed on it.
+// The users followed by user u are targets[offsets[u]] up to targets[offsets[u + 1]], not counting themselves
+struct GraphSnapshot {
+	time_t built;
+	std::vector<std::string> usernames;
+	std::vector<int> offsets;
+	std::vector<int> targets;
+	std::vector<int> follower_counts;
+	std::vector<int> top_users;
+	std::vector<std::vector<std::pair<int, int>>> recommendations;   // (user ID, number of followed users following them)
+	
+	void analyze(int threads);
 };
 
-// Struct to represent the user, consisting of a username, unread timeline posts, and followed users, 
-// as well as a semaphore for mutual exclusion and status flag to represent active users
+// Counts followers, ranks the most followed users, and recommends to each user the accounts most followed by
+// the users they follow. Every job is split across threads by user
+void GraphSnapshot::analyze(int threads) {
+	int n = usernames.size();
+	
+	// Each thread adds its users' edges to shared atomic follower counts
+	std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[n]);
+	for (int u = 0; u < n; u++)
+		counts[u].store(0, std::memory_order_relaxed);
+	parallelFor(n, threads, [&](int begin, int end) {
+		for (int u = begin; u < end; u++)
+			for (int e = offsets[u]; e < offsets[u + 1]; e++)
+				counts[targets[e]].fetch_add(1, std::memory_order_relaxed);
+	});
+	follower_counts.resize(n);
+	for (int u = 0; u < n; u++)
+		follower_counts[u] = counts[u].load(std::memory_order_relaxed);
+	
+	top_users.resize(n);
+	for (int u = 0; u < n; u++)
+		top_users[u] = u;
+	int k = std::min(n, TOP_USERS_SIZE);
+	std::partial_sort(begin(top_users), begin(top_users) + k, end(top_users), [&](int a, int b) {
+		return follower_counts[a] != follower_counts[b] ? follower_counts[a] > follower_counts[b] : a < b;
+	});
+	top_users.resize(k);
+	
+	// Friends of friends, scored by how many of the user's followed users follow them, using
+	// per-thread scratch arrays indexed by user ID
+	recommendations.assign(n, std::vector<std::pair<int, int>>());
+	parallelFor(n, threads, [&](int begin, int end) {
+		std::vector<int> scores(n, 0);
+		std::vector<char> followed(n, 0);
+		std::vector<int> touched;
+		for (int u = begin; u < end; u++) {
+			followed[u] = 1;
+			for (int e = offsets[u]; e < offsets[u + 1]; e++)
+				followed[targets[e]] = 1;
+			
+			for (int e = offsets[u]; e < offsets[u + 1]; e++) {
+				int v = targets[e];
+				for (int f = offsets[v]; f < offsets[v + 1]; f++) {
+					int w = targets[f];
+					if (followed[w])
+						continue;
+					if (scores[w]++ == 0)
+						touched.push_back(w);
+				}
+			}
+			
+			std::vector<std::pair<int, int>>& best = recommendations[u];
+			for (int w : touched)
+				best.push_back(std::make_pair(w, scores[w]));
+			int size = std::min((int) best.size(), RECOMMENDATIONS_SIZE);
+			std::partial_sort(best.begin(), best.begin() + size, best.end(), [&](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+				if (a.second != b.second)
+					return a.second > b.second;
+				if (follower_counts[a.first] != follower_counts[b.first])
+					return follower_counts[a.first] > follower_counts[b.first];
+				return a.first < b.first;
+			});
+			best.resize(size);
+			
+			// Reset the scratch arrays for the next user
+			for (int w : touched)
+				scores[w] = 0;
+			touched.clear();
+			followed[u] = 0;
+			for (int e = offsets[u]; e < offsets[u + 1]; e++)
+				followed[targets[e]] = 0;
+		}
+	});
+}
+
+// Maximum number of follower changes remembered per user for answering LIST with a delta
+#define FOLLOWER_LOG_SIZE 1024
+
+// Maximum number of edges in a single BulkFollow request, which holds the user table lock throughout
+#define BULK_FOLLOW_SIZE 10000
+
+// Struct to represent the user, consisting of an ID, username, unread timeline posts, and IDs of followed users, 
+// as well as a semaphore for mutual exclusion and status flag to represent active users.
+// in_timeline is set while a timeline session is open, until its threads have stopped and its semaphore is destroyed.
+// Users recovered from disk have their followed users loaded from file on first use, or at startup when the
+// follow graph analytics are on, after which loaded is set.
+// IDs are dense and assigned in registration order, so a user's ID is its index in the list of users.
+// Clients see IDs one higher, so that zero, the value of an unset proto3 field, never names a user.
+// The follower log records recent (follower, added) changes; its generation is follower_log_base plus its size
 struct User {
 	bool active;
+	bool in_timeline;
+	bool loaded;
+	int id;
 	std::string username;
 	sem_t mtx;
 	std::vector<Post> timeline;
-	std::vector<std::string> followed_users;
-	User(std::string _username) : username(_username), active(false) { }
+	std::vector<int> followed_users;
+	std::vector<std::pair<int, bool>> follower_log;
+	int64_t follower_log_base;
+	User(int _id, std::string _username) : active(false), in_timeline(false), loaded(false), id(_id), username(_username), follower_log_base(0) { }
+	bool follows(int user_id) const { return std::find(begin(followed_users), end(followed_users), user_id) != end(followed_users); }
+	int64_t followers_generation() const { return follower_log_base + follower_log.size(); }
 };
 
 // Logic and data behind the server's behavior.
@@ -45,7 +415,7 @@ class TSNServiceImpl final : public TSN::Service {
                    UserReply* reply) override;
                    
     // Lists all users, as well as the users the caller is currently following
-    Status ListUsers(ServerContext* context, const UserRequest* request,
+    Status ListUsers(ServerContext* context, const ListUsersRequest* request,
     			     ListUsersReply* reply) override;
     			     
     // Follows a user
@@ -61,28 +431,192 @@ class TSNServiceImpl final : public TSN::Service {
     Status ProcessTimeline(ServerContext* context, 
             ServerReaderWriter<PostMessage, PostMessage>* stream) override;
     
-    // Data structure to hold all active users in memory
-   	std::vector<User> users;
+    // Looks up the usernames for a list of user IDs
+    Status LookupUsers(ServerContext* context, const LookupUsersRequest* request,
+    				   LookupUsersReply* reply) override;
+    
+    // Registers many users at once without logging them in
+    Status BulkAddUsers(ServerContext* context, const BulkUserRequest* request,
+    					BulkReply* reply) override;
+    
+    // Applies many follow and unfollow edges at once
+    Status BulkFollow(ServerContext* context, const BulkFollowRequest* request,
+    				  BulkReply* reply) override;
+    
+    // Searches the posts of the users the caller follows for keywords
+    Status SearchPosts(ServerContext* context, const SearchRequest* request,
+    				   ServerWriter<PostMessage>* writer) override;
+    
+    // Recommends users to follow from the latest follow graph snapshot
+    Status WhoToFollow(ServerContext* context, const RecommendationRequest* request,
+    				   RecommendationReply* reply) override;
+    
+    // Lists the most followed users from the latest follow graph snapshot
+    Status TopUsers(ServerContext* context, const TopUsersRequest* request,
+    				TopUsersReply* reply) override;
+    
+    // Data structure to hold all active users in memory, indexed by ID, and the lock guarding it.
+    // A deque never moves its elements as it grows, so timeline threads can keep waiting on a user's semaphore
+   	std::deque<User> users;
+   	std::unordered_map<std::string, int> user_ids;
+   	std::mutex users_mtx;
+   	
+   	// Index of all posts for searching
+   	PostIndex index;
+   	
+   	// Latest follow graph snapshot, replaced atomically by the analytics thread, and the means of stopping that thread
+   	std::shared_ptr<const GraphSnapshot> graph;
+   	std::thread analytics;
+   	std::mutex analytics_mtx;
+   	std::condition_variable analytics_cv;
+   	bool stopping;
+   	
+   	// Identifies this run of the server so clients can tell when their cached lists are stale
+   	int64_t epoch;
+   	
+   	// Load shedding and per-user rate limits
+   	AdmissionControl admission;
+   	RateLimiter post_limiter;
+   	RateLimiter follow_limiter;
+   	std::atomic<int> timelines;
+   	int max_timelines;
+   	std::atomic<int> dropped_posts;
+   	std::atomic<int64_t> dropped_report_time;
+   	
+   	// Recording of incoming RPCs, if enabled
+   	TraceWriter tracer;
     
     public:
+    	TSNServiceImpl(const ServerOptions& options)
+    		: stopping(false), epoch(time(NULL)), admission(options.max_in_flight), post_limiter(options.post_rate, options.burst),
+    		  follow_limiter(options.follow_rate, options.burst), timelines(0), max_timelines(options.max_timelines),
+    		  dropped_posts(0), dropped_report_time(0) {
+    		if (!options.trace_path.empty() && !tracer.open(options.trace_path))
+    			std::cout << "ERROR: Could not open " << options.trace_path << " for recording\n";
+    	}
     	void recoverData();
+    	void loadAllFollowedUsers(int threads);
+    	void startAnalytics(int interval, int threads);
+    	void stopAnalytics();
     	
+    private:
+    	std::shared_ptr<GraphSnapshot> snapshotGraph();
+    	int findUser(const std::string& username) const;
+    	int resolveUser(const std::string& username, int id) const;
+    	void loadFollowedUsers(User& user);
+    	void recordFollowerChange(int user_id, int follower, bool added);
+    	void countDroppedPost();
 };
 
+// Returns the ID of the user with the given name, or -1 if they are not registered
+int TSNServiceImpl::findUser(const std::string& username) const {
+	auto pos = user_ids.find(username);
+	return pos == end(user_ids) ? -1 : pos->second;
+}
+
+// Returns the ID of the user a request refers to, by name if one was given and by client-facing ID otherwise,
+// or -1 if there is no such user or neither was given
+int TSNServiceImpl::resolveUser(const std::string& username, int id) const {
+	if (!username.empty())
+		return findUser(username);
+	return id > 0 && id <= (int) users.size() ? id - 1 : -1;
+}
+
+// Returns the ID clients know a user by
+static int clientId(int user_id) {
+	return user_id + 1;
+}
+
+// Reads the users a recovered user follows from file, the first time they are needed
+void TSNServiceImpl::loadFollowedUsers(User& user) {
+	if (user.loaded)
+		return;
+	user.loaded = true;
+	
+	std::ifstream infile{"data/users/" + user.username + ".txt"};
+	if (infile) {
+		//std::cout << "Found existing user file for " << user.username << "\n"; 
+		std::string user_to_follow;
+		while(infile >> user_to_follow) {
+			//std::cout << user_to_follow << "\n";
+			int follow_id = findUser(user_to_follow);
+			if (follow_id < 0 || user.follows(follow_id))
+				continue;
+			user.followed_users.push_back(follow_id);
+			recordFollowerChange(follow_id, user.id, true);
+		}
+		
+		infile.close();	
+	}
+}
+
+// Returns whether a username contains only valid characters
+static bool validUsername(const std::string& username) {
+	static const std::regex pattern("[A-Za-z0-9\\_\\.\\-]+");
+	return regex_match(username, pattern);
+}
+
+// Logs that a user gained or lost a follower, so LIST can report only what changed
+void TSNServiceImpl::recordFollowerChange(int user_id, int follower, bool added) {
+	if (user_id < 0)
+		return;
+	User* pos = &users[user_id];
+	
+	// Forget the oldest half of the log once it is full; clients behind it get the full list
+	if (pos->follower_log.size() >= FOLLOWER_LOG_SIZE) {
+		pos->follower_log_base += FOLLOWER_LOG_SIZE / 2;
+		pos->follower_log.erase(begin(pos->follower_log), begin(pos->follower_log) + FOLLOWER_LOG_SIZE / 2);
+	}
+	pos->follower_log.push_back(std::make_pair(follower, added));
+}
+
+// Counts a post dropped by the rate limiter, logging the total at most once every ten seconds
+// so that users flooding the server do not also flood its output
+void TSNServiceImpl::countDroppedPost() {
+	dropped_posts++;
+	int64_t now = time(NULL);
+	int64_t last = dropped_report_time;
+	if (now - last >= 10 && dropped_report_time.compare_exchange_strong(last, now))
+		std::cout << "Dropped " << dropped_posts.exchange(0) << " posts from users exceeding their post rate\n";
+}
+
+// Returns the last count lines of a user's timeline file, newest first. Each line is "<time> <poster> <content>"
+static std::vector<std::string> readRecentPosts(const std::string& username, int count) {
+	std::deque<std::string> lines;
+	std::ifstream infile{"data/timelines/" + username + ".txt"};
+	std::string line;
+	while (std::getline(infile, line)) {
+		lines.push_front(line);
+		if ((int) lines.size() > count)
+			lines.pop_back();
+	}
+	return std::vector<std::string>(begin(lines), end(lines));
+}
+
 Status TSNServiceImpl::AddUser(ServerContext* context, const UserRequest* request,
 								UserReply* reply) {
+    TraceScope trace(tracer, TRACE_ADD_USER, context, *request);
+    Admission admitted(admission, PRIORITY_HIGH);
+    if (!admitted.ok())
+    	return overloaded("Server is overloaded, try again later");
+    
     // Make sure username contains only valid characters
-    std::regex pattern("[A-Za-z0-9\\_\\.\\-]+");
-    if (!regex_match(request->username(), pattern))
+    if (!validUsername(request->username()))
     {
         // If not, return invalid username
         reply->set_status(3);
         return Status::OK;
     }
     
-    // Make sure username is not taken by an active user
-    auto user_pos = std::find_if(begin(users), end(users), [&](const User &u) { return u.username == request->username(); });
-    if (user_pos != end(users) && user_pos->active)
+    // Read the end of a returning user's timeline file before taking the lock, so a long timeline does not hold up other requests
+    std::vector<std::string> recent = readRecentPosts(request->username(), 20);
+    
+    std::lock_guard<std::mutex> lock(users_mtx);
+    
+    // Make sure username is not taken by an active user, or one whose last timeline is still shutting down
+    int user_id = findUser(request->username());
+    auto user_pos = user_id < 0 ? end(users) : begin(users) + user_id;
+    if (user_pos != end(users) && (user_pos->active || user_pos->in_timeline))
     {
         // If it is, return error
 	    reply->set_status(1);
@@ -94,45 +628,30 @@ Status TSNServiceImpl::AddUser(ServerContext* context, const UserRequest* reques
     	user_pos->active = true;
     	
         // Read following information from file
-        std::ifstream infile{"data/users/" + request->username() + ".txt"};
-  		if (infile) {
-  			//std::cout << "Found existing user file for " << request->username() << "\n"; 
-			//std::cout << "Followed users:" << "\n";
-  			std::string user_to_follow;
-  			while(infile >> user_to_follow) {
-  				std::cout << user_to_follow << "\n";
-  				user_pos->followed_users.push_back(user_to_follow);
-  			}
-  			
-  			infile.close();	
-  		}
+        loadFollowedUsers(*user_pos);
   		
-  		// Populate their timeline
-  		time_t time;
-  		std::string poster;
-  		std::string text;
-  		std::vector<Post> posts;
-  		infile.open("data/timelines/" + request->username() + ".txt");
-  		if (infile) {
-  			//std::cout << "Found timeline file\n";
-  			while (infile >> time >> poster >> text) 
-  				posts.insert(begin(posts), Post(time, poster, text));
-  			
-  			for (int i = 0; i < std::min(20, (int) posts.size()); i++) {
-  				user_pos->timeline.push_back(posts[i]);
-  				//std::cout << "Added post\n";
-  			}
+  		// Populate their timeline with the most recent posts, newest first
+  		for (const std::string& line : recent) {
+  			std::istringstream ss(line);
+  			time_t time;
+  			std::string poster;
+  			std::string text;
+  			if (!(ss >> time >> poster))
+  				continue;
+  			std::getline(ss >> std::ws, text);
+  			int poster_id = findUser(poster);
+  			if (poster_id >= 0)
+  				user_pos->timeline.push_back(Post(time, poster_id, text));
   		}
   		
-  		sem_init(&user_pos->mtx, 0, std::min(20, (int) posts.size()));
+  		sem_init(&user_pos->mtx, 0, user_pos->timeline.size());
         
         //std::cout << "Registered existing user " << request->username() << "\n";
     }
     // If the username is not registered
     else if (user_pos == end(users))
     {
-        User new_user(request->username());
-        new_user.active = true;
+        user_id = users.size();
         
         // Append username to users file
         std::ofstream outfile;
@@ -153,84 +672,140 @@ Status TSNServiceImpl::AddUser(ServerContext* context, const UserRequest* reques
         outfile << request->username() << "\n";
         outfile.close();
         
-  		new_user.followed_users.push_back(request->username());
+  		// Add them to the list of users and initialize their semaphore in place, since semaphores cannot be copied
+  		users.emplace_back(user_id, request->username());
+  		User& new_user = users.back();
+  		new_user.active = true;
+  		new_user.loaded = true;
+  		new_user.followed_users.push_back(user_id);
   		sem_init(&new_user.mtx, 0, 0);
-  		
-  		// Add them to the list of users and initialize their semaphore
-  		users.push_back(new_user);	
+  		user_ids[request->username()] = user_id;
+  		recordFollowerChange(user_id, user_id, true);
   		
         //std::cout << "Registered new user " << request->username() << "\n";
     }
  
+    reply->set_user_id(clientId(user_id));
     reply->set_status(0);
     return Status::OK;
 }
 
-Status TSNServiceImpl::ListUsers(ServerContext* context, const UserRequest* request,
+Status TSNServiceImpl::ListUsers(ServerContext* context, const ListUsersRequest* request,
 								 ListUsersReply* reply) {
+	TraceScope trace(tracer, TRACE_LIST_USERS, context, *request);
+	Admission admitted(admission, PRIORITY_LOW);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
+	
+	std::lock_guard<std::mutex> lock(users_mtx);
 	reply->set_followers("");
 	reply->set_all_users("");
 	
 	// Make sure user making request is registered
-	auto pos = std::find_if(begin(users), end(users), [&](const User &u) { return u.username == request->username(); });
-	if (pos == end(users)) {
+	int user_id = resolveUser(request->username(), request->user_id());
+	if (user_id < 0) {
 		reply->set_status(2);
 		return Status::OK;
 	}
+	User* pos = &users[user_id];
 	
-	// Go through all users, adding them as well as users following the current user
-	for (User& user : users) {
-		reply->set_all_users(reply->all_users() + user.username + "\n");	
-		auto pos = std::find_if(begin(user.followed_users), end(user.followed_users), [&](const User &u) { return u.username == request->username(); });
-		if (pos != end(user.followed_users)) {
-			reply->set_followers(reply->followers() + user.username + "\n");
+	// Users are only ever appended, so the list's generation is its size and the delta is its tail
+	int64_t users_generation = users.size();
+	bool same_epoch = request->epoch() == epoch;
+	bool users_delta = same_epoch && request->users_generation() >= 0 && request->users_generation() <= users_generation;
+	std::string all_users;
+	for (int64_t i = users_delta ? request->users_generation() : 0; i < users_generation; i++)
+		all_users += users[i].username + "\n";
+	
+	// Send only the net follower changes if the caller's generation is still in the log
+	int64_t followers_generation = pos->followers_generation();
+	bool followers_delta = same_epoch && request->followers_generation() >= pos->follower_log_base
+						   && request->followers_generation() <= followers_generation;
+	std::string followers;
+	std::string removed_followers;
+	if (followers_delta) {
+		// Keep the first and last change for each follower; the net effect is whichever they agree on
+		std::map<int, std::pair<bool, bool>> changes;
+		for (int64_t i = request->followers_generation() - pos->follower_log_base; i < (int64_t) pos->follower_log.size(); i++) {
+			auto& change = pos->follower_log[i];
+			auto it = changes.find(change.first);
+			if (it == end(changes))
+				changes[change.first] = std::make_pair(change.second, change.second);
+			else
+				it->second.second = change.second;
+		}
+		for (auto& change : changes) {
+			if (change.second.first && change.second.second)
+				followers += users[change.first].username + "\n";
+			else if (!change.second.first && !change.second.second)
+				removed_followers += users[change.first].username + "\n";
+		}
+	}
+	else {
+		// Go through all users, adding the ones following the current user
+		for (User& user : users) {
+			if (user.follows(user_id)) {
+				followers += user.username + "\n";
+			}
 		}
 	}
 	
+	reply->set_all_users(all_users);
+	reply->set_followers(followers);
+	reply->set_removed_followers(removed_followers);
+	reply->set_epoch(epoch);
+	reply->set_users_generation(users_generation);
+	reply->set_followers_generation(followers_generation);
+	reply->set_users_delta(users_delta);
+	reply->set_followers_delta(followers_delta);
 	reply->set_status(0);
 	return Status::OK;
 }
 
 Status TSNServiceImpl::FollowUser(ServerContext* context, const FollowUserRequest* request,
 								  UserReply* reply) {
+	TraceScope trace(tracer, TRACE_FOLLOW_USER, context, *request);
+	Admission admitted(admission, PRIORITY_NORMAL);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
 	
-	if (request->username() == request->user_to_follow()) {
-		reply->set_status(1);
-		return Status::OK;
-	}
+	std::lock_guard<std::mutex> lock(users_mtx);
 	
 	// Make sure the username making the request is registered
-	auto pos = std::find_if(begin(users), end(users), [&](const User &u) { return u.username == request->username(); });
-	if (pos == end(users)) {
+	int user_id = resolveUser(request->username(), request->user_id());
+	if (user_id < 0) {
 		reply->set_status(2);
 		return Status::OK;
 	}
+	User* pos = &users[user_id];
+	if (!follow_limiter.allow(user_id))
+		return overloaded("Too many follow requests, slow down");
+	loadFollowedUsers(*pos);
 	
 	// Make sure the user to follow is also registered
-	auto follow_pos = std::find_if(begin(users), end(users), [&](const User &u) { return u.username == request->user_to_follow(); });
-	if (follow_pos == end(users)) {
+	int follow_id = resolveUser(request->user_to_follow(), request->user_to_follow_id());
+	if (follow_id < 0) {
 		reply->set_status(3);
 		return Status::OK;
 	}
 	
-	// Make sure the user to follow is not already followed by the user making the request
-	for (std::string user : pos->followed_users) {
-		if (user == request->user_to_follow()) {
-			reply->set_status(1);
-			return Status::OK;
-		}
+	// Make sure the user to follow is not the user making the request or already followed by them
+	if (follow_id == user_id || pos->follows(follow_id)) {
+		reply->set_status(1);
+		return Status::OK;
 	}
 	
-	// Re-write the file of users that are being followed, omitting the unfollowed user	
+	// Append the followed user to the file of users that are being followed
 	std::ofstream outfile;
-	outfile.open("data/users/" + request->username() + ".txt", std::ios_base::app);
+	outfile.open("data/users/" + pos->username + ".txt", std::ios_base::app);
 	if (outfile) {
-		pos->followed_users.push_back(request->user_to_follow());
-		outfile << request->user_to_follow() << "\n";
+		pos->followed_users.push_back(follow_id);
+		outfile << users[follow_id].username << "\n";
 		outfile.close();
+		recordFollowerChange(follow_id, user_id, true);
 	}
 	else {
-		std::cout << "ERROR: data/users/" + request->username() + " could not be opened!\n";
+		std::cout << "ERROR: data/users/" + pos->username + " could not be opened!\n";
 		reply->set_status(5);
 		return Status::OK;
 	}
@@ -241,16 +816,27 @@ Status TSNServiceImpl::FollowUser(ServerContext* context, const FollowUserReques
 
 Status TSNServiceImpl::UnfollowUser(ServerContext* context, const UnfollowUserRequest* request,
 								  UserReply* reply) {
+	TraceScope trace(tracer, TRACE_UNFOLLOW_USER, context, *request);
+	Admission admitted(admission, PRIORITY_NORMAL);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
 	
-	// Check if user is attempting to unregister themselves		  
-	if (request->username() == request->user_to_unfollow()) {
+	std::lock_guard<std::mutex> lock(users_mtx);
+	
+	// Check if user making request is registered
+	int user_id = resolveUser(request->username(), request->user_id());
+	if (user_id < 0) {
 		reply->set_status(3);
 		return Status::OK;
 	}
+	User* pos = &users[user_id];
+	if (!follow_limiter.allow(user_id))
+		return overloaded("Too many unfollow requests, slow down");
+	loadFollowedUsers(*pos);
 	
-	// Check if user making request is registered
-	auto pos = std::find_if(begin(users), end(users), [&](const User &u) { return u.username == request->username(); });
-	if (pos == end(users)) {
+	// Check if user is attempting to unregister themselves		  
+	int unfollow_id = resolveUser(request->user_to_unfollow(), request->user_to_unfollow_id());
+	if (unfollow_id == user_id) {
 		reply->set_status(3);
 		return Status::OK;
 	}
@@ -258,20 +844,21 @@ Status TSNServiceImpl::UnfollowUser(ServerContext* context, const UnfollowUserRe
 	// Attempt to unfollow the user
 	bool found = false;
 	for (int i = 0; i < pos->followed_users.size(); i++) {
-		if (pos->followed_users[i] == request->user_to_unfollow()) {
+		if (pos->followed_users[i] == unfollow_id) {
 			pos->followed_users.erase(begin(pos->followed_users) + i);
 			found = true;
+			recordFollowerChange(unfollow_id, user_id, false);
 			
 			// Record updates on disk
 			std::ofstream outfile;
-			outfile.open("data/users/" + request->username() + ".txt");
+			outfile.open("data/users/" + pos->username + ".txt");
 			if (outfile) {
-				for (std::string user : pos->followed_users)
-					outfile << user << "\n";
+				for (int user : pos->followed_users)
+					outfile << users[user].username << "\n";
 				outfile.close();
 			}
 			else {
-				std::cout << "ERROR: data/users/" + request->username() + " could not be opened!\n";
+				std::cout << "ERROR: data/users/" + pos->username + " could not be opened!\n";
 				reply->set_status(5);
 				return Status::OK;			
 			}
@@ -293,27 +880,71 @@ Status TSNServiceImpl::UnfollowUser(ServerContext* context, const UnfollowUserRe
 Status TSNServiceImpl::ProcessTimeline(ServerContext* context, 
             ServerReaderWriter<PostMessage, PostMessage>* stream) {
 	
+	// Turn the client away if too many users are already in timeline mode
+	if (timelines++ >= max_timelines && max_timelines > 0) {
+		timelines--;
+		return overloaded("Too many users in timeline mode, try again later");
+	}
+	
 	// Get user info     
     PostMessage userinfo;
     if (!stream->Read(&userinfo)) {
 		std::cout << "ERROR: Client unexpectedly closed connection\n";
+		timelines--;
 		return Status::OK;
 	}
+	users_mtx.lock();
+	int user_id = resolveUser(userinfo.sender(), userinfo.sender_id());
+	User* me = user_id >= 0 ? &users[user_id] : nullptr;
+	bool active = me && me->active;
+	bool streaming = me && me->in_timeline;
+	if (active && !streaming)
+		me->in_timeline = true;
+	users_mtx.unlock();
+	if (user_id < 0) {
+		timelines--;
+		return Status(StatusCode::NOT_FOUND, "User is not registered");
+	}
+	// Only logged in users have a timeline to wait on, and each user's semaphore serves a single timeline
+	if (!active) {
+		timelines--;
+		return Status(StatusCode::FAILED_PRECONDITION, "User is not logged in");
+	}
+	if (streaming) {
+		timelines--;
+		return Status(StatusCode::ALREADY_EXISTS, "User already has a timeline open");
+	}
+    
+	// Record the stream in the trace, starting with the message identifying the user
+	uint32_t session = tracer.isEnabled() ? tracer.session(clientSession(context)) : 0;
+	uint64_t trace_stream = tracer.isEnabled() ? tracer.stream() : 0;
+	tracer.record(TRACE_TIMELINE_POST, session, trace_stream, std::chrono::steady_clock::now(), 0, userinfo);
     
 	// Read messages from the client and write them to following users timelines (and to files in ../data/timelines for persistence)
-   	std::thread reader{[stream](TSNServiceImpl* service, std::string username) {
+   	std::atomic<bool> closed(false);
+   	std::thread reader{[stream, session, trace_stream, &closed, me](TSNServiceImpl* service, int user_id) {
 	
 		PostMessage p;
 		// Get post from user
-    	while(stream->Read(&p)) {      		
+    	while(stream->Read(&p)) {
+    		service->tracer.record(TRACE_TIMELINE_POST, session, trace_stream, std::chrono::steady_clock::now(), 0, p);
+    		
+    		// Drop posts from users exceeding their post rate
+    		if (!service->post_limiter.allow(user_id)) {
+    			service->countDroppedPost();
+    			continue;
+    		}
+    		
+    		service->index.add(Post(p.time(), user_id, p.content()));
+    		
     		// Loop through all users and find the ones that have followed the user that just made the post
+    		std::lock_guard<std::mutex> lock(service->users_mtx);
             for (User& user : service->users) {
-				auto pos = std::find_if(begin(user.followed_users), end(user.followed_users), [&](const User &u) { return u.username == username; });
-				if (pos != end(user.followed_users)) {
+				if (user.follows(user_id)) {
 					
 					// Make sure the timeline doesn't exceed 20 items
-					Post new_post(p.time(), p.sender(), p.content());
-					while(user.timeline.size() >= 20) {
+					Post new_post(p.time(), user_id, p.content());
+					while(user.active && user.timeline.size() >= 20) {
 						sem_wait(&user.mtx);
 						user.timeline.pop_back();
 					}
@@ -322,54 +953,424 @@ Status TSNServiceImpl::ProcessTimeline(ServerContext* context,
 					std::ofstream outfile;
 					outfile.open("data/timelines/" + user.username + ".txt", std::ios_base::app);
 					if (outfile) {
-						outfile << new_post.time << " " << new_post.poster << " " << new_post.text << "\n";
+						outfile << new_post.time << " " << service->users[user_id].username << " " << new_post.text << "\n";
 						outfile.close();
 					}
 					else {
 						std::cout << "ERROR: Could not open data/timelines/" + user.username + ".txt for writing\n";
 					}
 					
-					// If the user isn't the one who made the post, also send them the message
-					if (user.username != username) {
+					// If the user isn't the one who made the post and is logged in, also send them the message
+					if (user.id != user_id && user.active) {
 						user.timeline.insert(begin(user.timeline), new_post);
 						sem_post(&user.mtx);
 					}
 				}      	
             }
     	}	
+    	
+    	// The client has gone away, so wake the writer to stop it, even if nobody posts to them again. Clearing
+    	// active first keeps posters from waiting on the semaphore and taking the wake-up meant for the writer
+    	service->users_mtx.lock();
+    	me->active = false;
+    	closed = true;
+    	sem_post(&me->mtx);
+    	service->users_mtx.unlock();
     
-    }, this, userinfo.sender()};
+    }, this, user_id};
 
-    std::thread writer{[stream](TSNServiceImpl* service, std::string username) {
-		// Constantly look for content added to the users' own timeline and write it to the client
-		auto pos = std::find_if(begin(service->users), end(service->users), [&](const User &u) { return u.username == username; });
-		if (pos == end(service->users)) {
-			return Status::OK;
-		}
-		
+    std::thread writer{[stream, &closed](TSNServiceImpl* service, User* pos) {
         PostMessage new_post;
         
         // Wait for items to be added to the user's timeline, then send them to the client and remove them from the timeline
         while(true){
-        	//std::cout << "Waiting on mutex for " << username << "\n";
+        	//std::cout << "Waiting on mutex for " << pos->id << "\n";
 			sem_wait(&pos->mtx);
+			if (closed)
+				break;
+			service->users_mtx.lock();
         	new_post.set_time(pos->timeline.front().time);
         	new_post.set_content(pos->timeline.front().text);
-        	new_post.set_sender(pos->timeline.front().poster);
+        	new_post.set_sender_id(clientId(pos->timeline.front().poster));
         	pos->timeline.erase(begin(pos->timeline));
+        	service->users_mtx.unlock();
             
-        	stream->Write(new_post);				
+        	// Stop once the client has gone away
+        	if (!stream->Write(new_post))
+        		break;
 		}
-   	}, this, userinfo.sender()};
+		return Status::OK;
+   	}, this, me};
 
    	//Wait for the threads to finish
    	writer.join();
     reader.join();
+    
+    // Log the user out for good now that neither thread can touch the semaphore, discarding the posts that were
+    // never sent since they are read again from file on the next login. Until this point AddUser treats them as busy
+    users_mtx.lock();
+    me->active = false;
+    me->timeline.clear();
+    sem_destroy(&me->mtx);
+    me->in_timeline = false;
+    users_mtx.unlock();
+    timelines--;
 
     return Status::OK;
 }
 
-// Read all users from the users file, marking each as inactive until they re-register
+Status TSNServiceImpl::LookupUsers(ServerContext* context, const LookupUsersRequest* request,
+								   LookupUsersReply* reply) {
+	TraceScope trace(tracer, TRACE_LOOKUP_USERS, context, *request);
+	// Unknown IDs are answered with an empty name so the reply lines up with the request
+	std::lock_guard<std::mutex> lock(users_mtx);
+	for (int id : request->user_ids()) {
+		int user_id = resolveUser("", id);
+		if (user_id >= 0)
+			reply->add_usernames(users[user_id].username);
+		else
+			reply->add_usernames("");
+	}
+	return Status::OK;
+}
+
+Status TSNServiceImpl::BulkAddUsers(ServerContext* context, const BulkUserRequest* request,
+									BulkReply* reply) {
+	TraceScope trace(tracer, TRACE_BULK_ADD_USERS, context, *request);
+	Admission admitted(admission, PRIORITY_NORMAL);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
+	
+	std::lock_guard<std::mutex> lock(users_mtx);
+	
+	// Validate every user first, collecting the new names for a single write. IDs are handed out in
+	// request order, and a name repeated within the request gets the ID of its first occurrence
+	std::string new_users;
+	std::vector<std::string> added;
+	std::vector<int> added_items;
+	std::unordered_map<std::string, int> pending;
+	for (const std::string& username : request->usernames()) {
+		if (!validUsername(username)) {
+			reply->add_statuses(3);
+			reply->add_user_ids(0);
+			continue;
+		}
+		int user_id = findUser(username);
+		auto pos = pending.find(username);
+		if (user_id < 0 && pos != end(pending))
+			user_id = pos->second;
+		if (user_id >= 0) {
+			reply->add_statuses(1);
+			reply->add_user_ids(clientId(user_id));
+			continue;
+		}
+		
+		user_id = users.size() + added.size();
+		pending[username] = user_id;
+		new_users += username + "\n";
+		added.push_back(username);
+		added_items.push_back(reply->statuses_size());
+		reply->add_statuses(0);
+		reply->add_user_ids(clientId(user_id));
+	}
+	
+	// Append all new users to the users file at once. If that fails none of them are registered,
+	// so IDs in memory keep matching the order of users.txt
+	reply->set_status(0);
+	std::ofstream outfile;
+	outfile.open("data/users.txt", std::ios_base::app);
+	if (outfile)
+		outfile << new_users;
+	if (!outfile) {
+		std::cout << "ERROR: Could not write to data/users.txt" << std::endl;
+		for (int item : added_items) {
+			reply->set_statuses(item, 5);
+			reply->set_user_ids(item, 0);
+		}
+		reply->set_status(5);
+		return Status::OK;
+	}
+	outfile.close();
+	
+	// Only then register them. New users follow themselves, and stay logged out until they call AddUser
+	for (const std::string& username : added) {
+		int user_id = users.size();
+		users.emplace_back(user_id, username);
+		users.back().loaded = true;
+		users.back().followed_users.push_back(user_id);
+		user_ids[username] = user_id;
+		recordFollowerChange(user_id, user_id, true);
+	}
+	
+	// Give each new user their file of followed users
+	for (const std::string& username : added) {
+		outfile.open("data/users/" + username + ".txt");
+		if (!outfile) {
+			std::cout << "ERROR: Could not write to data/users/" << username << std::endl;
+			reply->set_status(5);
+			outfile.clear();
+			continue;
+		}
+		outfile << username << "\n";
+		outfile.close();
+	}
+	
+	return Status::OK;
+}
+
+Status TSNServiceImpl::BulkFollow(ServerContext* context, const BulkFollowRequest* request,
+								  BulkReply* reply) {
+	TraceScope trace(tracer, TRACE_BULK_FOLLOW, context, *request);
+	Admission admitted(admission, PRIORITY_NORMAL);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
+	if (request->edges_size() > BULK_FOLLOW_SIZE)
+		return Status(StatusCode::INVALID_ARGUMENT, "Too many edges, send at most " + std::to_string(BULK_FOLLOW_SIZE) + " per request");
+	
+	std::lock_guard<std::mutex> lock(users_mtx);
+	
+	// Each user in the batch spends one follow request from their rate, as if they had sent a single FOLLOW
+	std::set<int> followers;
+	for (const FollowEdge& edge : request->edges())
+		followers.insert(resolveUser(edge.username(), edge.user_id()));
+	followers.erase(-1);
+	for (int user_id : followers)
+		if (!follow_limiter.allow(user_id))
+			return overloaded("Too many follow requests, slow down");
+	
+	// Validate and apply every edge in one pass, using the same statuses as FollowUser and UnfollowUser.
+	// Users who only gained follows have the new names appended to their file; the rest are rewritten.
+	// Each changed user's original list and applied edges are kept so the changes can be undone if saving fails
+	struct Change {
+		std::vector<int> original;
+		std::string appended;
+		bool rewrite = false;
+		std::vector<std::pair<int, bool>> edges;
+		std::vector<int> items;
+	};
+	std::map<int, Change> changes;
+	for (const FollowEdge& edge : request->edges()) {
+		int user_id = resolveUser(edge.username(), edge.user_id());
+		int other_id = resolveUser(edge.user_to_follow(), edge.user_to_follow_id());
+		if (user_id < 0) {
+			reply->add_statuses(edge.unfollow() ? 3 : 2);
+			continue;
+		}
+		User& user = users[user_id];
+		loadFollowedUsers(user);
+		
+		int status = 0;
+		if (!edge.unfollow()) {
+			if (other_id < 0)
+				status = 3;
+			else if (other_id == user_id || user.follows(other_id))
+				status = 1;
+		}
+		else if (other_id < 0 || other_id == user_id || !user.follows(other_id)) {
+			status = 3;
+		}
+		if (status != 0) {
+			reply->add_statuses(status);
+			continue;
+		}
+		
+		auto pos = changes.find(user_id);
+		if (pos == end(changes)) {
+			pos = changes.emplace(user_id, Change()).first;
+			pos->second.original = user.followed_users;
+		}
+		Change& change = pos->second;
+		if (!edge.unfollow()) {
+			user.followed_users.push_back(other_id);
+			change.appended += users[other_id].username + "\n";
+		}
+		else {
+			user.followed_users.erase(std::find(begin(user.followed_users), end(user.followed_users), other_id));
+			change.rewrite = true;
+		}
+		recordFollowerChange(other_id, user_id, !edge.unfollow());
+		change.edges.push_back(std::make_pair(other_id, !edge.unfollow()));
+		change.items.push_back(reply->statuses_size());
+		reply->add_statuses(0);
+	}
+	
+	// Record the updates on disk with one write per affected user. A user whose file cannot be written
+	// gets their edges undone in memory, and those items report status 5
+	reply->set_status(0);
+	std::ofstream outfile;
+	for (auto& pos : changes) {
+		User& user = users[pos.first];
+		Change& change = pos.second;
+		std::string contents = change.appended;
+		if (change.rewrite) {
+			contents.clear();
+			for (int followed : user.followed_users)
+				contents += users[followed].username + "\n";
+		}
+		
+		outfile.open("data/users/" + user.username + ".txt", change.rewrite ? std::ios_base::trunc : std::ios_base::app);
+		if (outfile) {
+			outfile << contents;
+			outfile.close();
+			if (outfile)
+				continue;
+		}
+		std::cout << "ERROR: data/users/" + user.username + " could not be written!\n";
+		outfile.clear();
+		
+		user.followed_users = change.original;
+		for (auto edge = change.edges.rbegin(); edge != change.edges.rend(); ++edge)
+			recordFollowerChange(edge->first, user.id, !edge->second);
+		for (int item : change.items)
+			reply->set_statuses(item, 5);
+		reply->set_status(5);
+	}
+	
+	return Status::OK;
+}
+
+Status TSNServiceImpl::SearchPosts(ServerContext* context, const SearchRequest* request,
+								   ServerWriter<PostMessage>* writer) {
+	TraceScope trace(tracer, TRACE_SEARCH_POSTS, context, *request);
+	Admission admitted(admission, PRIORITY_LOW);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
+	
+	// Search only the posts of the users the caller follows, including their own
+	std::unordered_set<int> posters;
+	{
+		std::lock_guard<std::mutex> lock(users_mtx);
+		int user_id = resolveUser(request->username(), request->user_id());
+		if (user_id < 0)
+			return Status(StatusCode::NOT_FOUND, "User is not registered");
+		loadFollowedUsers(users[user_id]);
+		posters.insert(begin(users[user_id].followed_users), end(users[user_id].followed_users));
+	}
+	
+	int limit = request->limit() > 0 ? std::min(request->limit(), 1000) : 20;
+	PostMessage message;
+	for (const Post& post : index.search(request->query(), posters, limit)) {
+		message.set_time(post.time);
+		message.set_sender_id(clientId(post.poster));
+		message.set_content(post.text);
+		if (!writer->Write(message))
+			break;
+	}
+	return Status::OK;
+}
+
+// Copies the follow graph into a new snapshot. Every user's followed users were loaded before the server
+// started serving, so only the in-memory copy is made under the lock and live requests are held up briefly
+std::shared_ptr<GraphSnapshot> TSNServiceImpl::snapshotGraph() {
+	std::shared_ptr<GraphSnapshot> snapshot = std::make_shared<GraphSnapshot>();
+	std::lock_guard<std::mutex> lock(users_mtx);
+	snapshot->built = time(NULL);
+	snapshot->offsets.reserve(users.size() + 1);
+	snapshot->offsets.push_back(0);
+	for (User& user : users) {
+		snapshot->usernames.push_back(user.username);
+		for (int followed : user.followed_users)
+			if (followed != user.id)
+				snapshot->targets.push_back(followed);
+		snapshot->offsets.push_back(snapshot->targets.size());
+	}
+	return snapshot;
+}
+
+// Rebuilds the follow graph snapshot and its analytics every interval seconds in the background, until stopped
+void TSNServiceImpl::startAnalytics(int interval, int threads) {
+	if (interval <= 0)
+		return;
+	analytics = std::thread([this, interval, threads]() {
+		std::unique_lock<std::mutex> lock(analytics_mtx);
+		while (!stopping) {
+			lock.unlock();
+			std::shared_ptr<GraphSnapshot> snapshot = snapshotGraph();
+			snapshot->analyze(threads);
+			std::atomic_store(&graph, std::shared_ptr<const GraphSnapshot>(snapshot));
+			lock.lock();
+			analytics_cv.wait_for(lock, std::chrono::seconds(interval), [this]() { return stopping; });
+		}
+	});
+}
+
+// Stops the analytics thread, waiting for any rebuild in progress to finish
+void TSNServiceImpl::stopAnalytics() {
+	{
+		std::lock_guard<std::mutex> lock(analytics_mtx);
+		stopping = true;
+	}
+	analytics_cv.notify_all();
+	if (analytics.joinable())
+		analytics.join();
+}
+
+Status TSNServiceImpl::WhoToFollow(ServerContext* context, const RecommendationRequest* request,
+								   RecommendationReply* reply) {
+	TraceScope trace(tracer, TRACE_WHO_TO_FOLLOW, context, *request);
+	Admission admitted(admission, PRIORITY_LOW);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
+	
+	std::shared_ptr<const GraphSnapshot> snapshot = std::atomic_load(&graph);
+	if (!snapshot)
+		return Status(StatusCode::UNAVAILABLE, "Follow graph analytics are not ready yet");
+	
+	// Users registered since the snapshot was built have no recommendations yet
+	int user_id;
+	{
+		std::lock_guard<std::mutex> lock(users_mtx);
+		user_id = resolveUser(request->username(), request->user_id());
+	}
+	if (user_id < 0) {
+		reply->set_status(2);
+		return Status::OK;
+	}
+	
+	reply->set_snapshot_time(snapshot->built);
+	if (user_id < (int) snapshot->usernames.size()) {
+		reply->set_follower_count(snapshot->follower_counts[user_id]);
+		int limit = request->limit() > 0 ? request->limit() : RECOMMENDATIONS_SIZE;
+		for (auto& recommendation : snapshot->recommendations[user_id]) {
+			if (reply->users_size() >= limit)
+				break;
+			RankedUser* user = reply->add_users();
+			user->set_user_id(clientId(recommendation.first));
+			user->set_username(snapshot->usernames[recommendation.first]);
+			user->set_score(recommendation.second);
+		}
+	}
+	
+	reply->set_status(0);
+	return Status::OK;
+}
+
+Status TSNServiceImpl::TopUsers(ServerContext* context, const TopUsersRequest* request,
+								TopUsersReply* reply) {
+	TraceScope trace(tracer, TRACE_TOP_USERS, context, *request);
+	Admission admitted(admission, PRIORITY_LOW);
+	if (!admitted.ok())
+		return overloaded("Server is overloaded, try again later");
+	
+	std::shared_ptr<const GraphSnapshot> snapshot = std::atomic_load(&graph);
+	if (!snapshot)
+		return Status(StatusCode::UNAVAILABLE, "Follow graph analytics are not ready yet");
+	
+	reply->set_snapshot_time(snapshot->built);
+	int limit = request->limit() > 0 ? request->limit() : 10;
+	for (int id : snapshot->top_users) {
+		if (reply->users_size() >= limit)
+			break;
+		RankedUser* user = reply->add_users();
+		user->set_user_id(clientId(id));
+		user->set_username(snapshot->usernames[id]);
+		user->set_score(snapshot->follower_counts[id]);
+	}
+	return Status::OK;
+}
+
+// Read all users from the users file, marking each as inactive until they re-register.
+// Then rebuild the search index from everyone's own posts, which are kept in their timeline files
 void TSNServiceImpl::recoverData() {
 	std::ifstream infile{"data/users.txt"};
 	if (infile) {
@@ -377,37 +1378,176 @@ void TSNServiceImpl::recoverData() {
 		std::string username;
 		while(std::getline(infile, username)) {
 			//std::cout << "Found existing user " << username << "\n";
-			User user(username);
-			user.active = false;
-			users.push_back(user);
+			user_ids[username] = users.size();
+			users.emplace_back(users.size(), username);
 		}
 		infile.close();
 	}	
+	
+	std::vector<Post> posts;
+	for (User& user : users) {
+		infile.open("data/timelines/" + user.username + ".txt");
+		std::string line;
+		while (std::getline(infile, line)) {
+			std::istringstream ss(line);
+			time_t time;
+			std::string poster;
+			std::string text;
+			if (!(ss >> time >> poster) || poster != user.username)
+				continue;
+			std::getline(ss >> std::ws, text);
+			posts.push_back(Post(time, user.id, text));
+		}
+		infile.close();
+		infile.clear();
+	}
+	std::stable_sort(begin(posts), end(posts), [](const Post& a, const Post& b) { return a.time < b.time; });
+	for (const Post& post : posts)
+		index.add(post);
 }
 
-void RunServer() {
-  	std::string server_address("0.0.0.0:3010");
-  	TSNServiceImpl service;
-  	service.recoverData();
+// Reads every recovered user's followed users up front, for the follow graph analytics. The files are read
+// in parallel, then applied in order, since loading a user also updates the follower logs of others
+void TSNServiceImpl::loadAllFollowedUsers(int threads) {
+	std::vector<std::vector<std::string>> followed(users.size());
+	parallelFor(users.size(), threads, [&](int begin, int end) {
+		for (int id = begin; id < end; id++) {
+			if (users[id].loaded)
+				continue;
+			std::ifstream infile{"data/users/" + users[id].username + ".txt"};
+			std::string user_to_follow;
+			while (infile >> user_to_follow)
+				followed[id].push_back(user_to_follow);
+		}
+	});
+	
+	for (User& user : users) {
+		if (user.loaded)
+			continue;
+		user.loaded = true;
+		for (const std::string& user_to_follow : followed[user.id]) {
+			int follow_id = findUser(user_to_follow);
+			if (follow_id < 0 || user.follows(follow_id))
+				continue;
+			user.followed_users.push_back(follow_id);
+			recordFollowerChange(follow_id, user.id, true);
+		}
+	}
+}
+
+std::shared_ptr<Server> StartServer(const ServerOptions& options) {
+  	int threads = std::max(1u, std::thread::hardware_concurrency());
+  	TSNServiceImpl* service = new TSNServiceImpl(options);
+  	service->recoverData();
+  	// Snapshots copy every user's followed users, so read them all before serving rather than under the lock later
+  	if (options.graph_interval > 0)
+  		service->loadAllFollowedUsers(threads);
+  	service->startAnalytics(options.graph_interval, threads);
 		
   	ServerBuilder builder;
+  	// Cap the threads the server may use so a burst of clients cannot exhaust them
+  	grpc::ResourceQuota quota("tsd");
+  	if (options.max_threads > 0)
+  		quota.SetMaxThreads(options.max_threads);
+  	builder.SetResourceQuota(quota);
+  	if (options.max_streams > 0)
+  		builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, options.max_streams);
   	// Listen on the given address without any authentication mechanism.
-  	builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  	if (!options.port.empty())
+  		builder.AddListeningPort("0.0.0.0:" + options.port, grpc::InsecureServerCredentials());
+  	// Local clients can skip the TCP stack through a Unix domain socket. Remove any socket
+  	// left behind by a previous run first, or binding to it fails, but never anything else at that path
+  	if (!options.socket_path.empty()) {
+  		struct stat info;
+  		if (lstat(options.socket_path.c_str(), &info) == 0 && !S_ISSOCK(info.st_mode))
+  			std::cout << "ERROR: " << options.socket_path << " exists and is not a socket" << std::endl;
+  		else
+  			unlink(options.socket_path.c_str());
+  		builder.AddListeningPort("unix:" + options.socket_path, grpc::InsecureServerCredentials());
+  	}
   	// Register "service" as the instance through which we'll communicate with
   	// clients. In this case it corresponds to an *synchronous* service.
-  	builder.RegisterService(&service);
+  	builder.RegisterService(service);
   	// Finally assemble the server.
   	std::unique_ptr<Server> server(builder.BuildAndStart());
-  	std::cout << "Server listening on " << server_address << std::endl;
+  	if (!server) {
+  		service->stopAnalytics();
+  		delete service;
+  		return nullptr;
+  	}
+  	// Timelines stay open until their clients leave, so give in-flight calls a moment and then cancel
+  	// the rest, which ends their timeline threads. Then stop the analytics thread before freeing the service
+  	return std::shared_ptr<Server>(server.release(), [service](Server* server) {
+  		server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+  		delete server;
+  		service->stopAnalytics();
+  		delete service;
+  	});
+}
+
+void RunServer(const ServerOptions& options) {
+  	std::shared_ptr<Server> server = StartServer(options);
+  	if (!server) {
+  		std::cout << "ERROR: Could not start the server" << std::endl;
+  		return;
+  	}
+  	if (!options.port.empty())
+  		std::cout << "Server listening on 0.0.0.0:" << options.port << std::endl;
+  	if (!options.socket_path.empty())
+  		std::cout << "Server listening on unix:" << options.socket_path << std::endl;
 
   	// Wait for the server to shutdown. Note that some other thread must be
   	// responsible for shutting down the server for this call to ever return.
   	server->Wait();
 }
 
+// When built as tsd_embedded.o for running the server inside another program, leave out main
+#ifndef TSD_EMBEDDED
 int main(int argc, char** argv) {
-  	RunServer();
+	ServerOptions options;
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "p:s:c:t:q:l:r:f:b:R:g:")) != -1) {
+		switch(opt) {
+		case 'p':
+			options.port = optarg;
+		break;
+		case 's':
+			options.socket_path = optarg;
+		break;
+		case 'c':
+			options.max_streams = atoi(optarg);
+		break;
+		case 't':
+			options.max_threads = atoi(optarg);
+		break;
+		case 'q':
+			options.max_in_flight = atoi(optarg);
+		break;
+		case 'l':
+			options.max_timelines = atoi(optarg);
+		break;
+		case 'r':
+			options.post_rate = atof(optarg);
+		break;
+		case 'f':
+			options.follow_rate = atof(optarg);
+		break;
+		case 'b':
+			options.burst = atof(optarg);
+		break;
+		case 'R':
+			options.trace_path = optarg;
+		break;
+		case 'g':
+			options.graph_interval = atoi(optarg);
+		break;
+		default:
+			std::cerr << "Invalid Command Line Argument\n";
+		}
+	}
+	
+  	RunServer(options);
 
   	return 0;
 }
-
+#endif
@@ -0,0 +1,32 @@
+#ifndef TSD_H
+#define TSD_H
+
+#include <string>
+#include <memory>
+#include <grpc++/grpc++.h>
+
+// Tunable limits for the server, set from the command line. A value of zero leaves the limit disabled
+struct ServerOptions {
+	std::string port = "3010";      // TCP port to listen on, or empty to not listen on TCP
+	std::string socket_path;        // Unix domain socket to also listen on, for clients on the same host
+	int max_streams = 0;            // Maximum concurrent streams per client connection
+	int max_threads = 0;            // Maximum threads the synchronous server may spawn
+	int max_in_flight = 0;          // Maximum unary requests handled at once before shedding load
+	int max_timelines = 0;          // Maximum clients in timeline mode at once
+	double post_rate = 0;           // Posts per second allowed for each user
+	double follow_rate = 0;         // Follow/unfollow requests per second allowed for each user
+	double burst = 10;              // Number of posts or follow changes a user may make back to back
+	std::string trace_path;         // File to record incoming RPCs to for tsreplay
+	int graph_interval = 60;        // Seconds between rebuilds of the follow graph analytics
+};
+
+/*
+ * Loads the server's data from the data directory and starts serving it on the ports in the options.
+ * Returns null if the server could not be started. The service is destroyed along with the server.
+ *
+ * Programs linking tsd_embedded.o can run the server in their own process and connect to it
+ * through server->InProcessChannel(), skipping the network stack entirely.
+ */
+std::shared_ptr<grpc::Server> StartServer(const ServerOptions& options);
+
+#endif
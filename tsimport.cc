@@ -0,0 +1,355 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <regex>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// Offline tool that builds the server's data directory (users.txt, users/<name>.txt and
+// timelines/<name>.txt) from a dump of the follow graph and posts, so tsd can start on it directly.
+//
+// The edge list has one "<follower> <followed>" pair per line, and the post archive one
+// "<time> <poster> <content>" post per line. An optional users file lists extra users, one per line.
+
+// A post from the archive, with the poster's ID in place of their name
+struct Post {
+	time_t time;
+	int poster;
+	std::string text;
+	Post(time_t _time, int _poster, std::string _text) : time(_time), poster(_poster), text(_text) {}
+};
+
+// Everything read from the dump. User IDs follow the order users are first seen, which is the order
+// they are written to users.txt and therefore the IDs tsd will assign them
+struct Dump {
+	std::vector<std::string> usernames;
+	std::unordered_map<std::string, int> user_ids;
+	std::vector<std::vector<int>> followed_users;
+	std::vector<Post> posts;
+	int skipped = 0;
+
+	int intern(const std::string& username);
+};
+
+// Returns the ID of a user, adding them if this is the first time they are seen
+int Dump::intern(const std::string& username) {
+	auto pos = user_ids.find(username);
+	if (pos != end(user_ids))
+		return pos->second;
+
+	int id = usernames.size();
+	usernames.push_back(username);
+	user_ids[username] = id;
+	followed_users.push_back(std::vector<int>(1, id));
+	return id;
+}
+
+// Returns whether a username contains only characters the server accepts
+static bool validUsername(const std::string& username) {
+	static const std::regex pattern("[A-Za-z0-9\\_\\.\\-]+");
+	return regex_match(username, pattern);
+}
+
+// Reads a whole file into memory, with a single read when its size is known. Inputs that
+// cannot be seeked, such as pipes, are read to the end instead
+static bool readFile(const std::string& path, std::string& contents) {
+	std::ifstream infile(path, std::ios_base::binary);
+	if (!infile)
+		return false;
+	infile.seekg(0, std::ios_base::end);
+	std::streamoff size = infile.tellg();
+	if (size < 0) {
+		infile.clear();
+		std::ostringstream buffer;
+		buffer << infile.rdbuf();
+		contents = buffer.str();
+		return !infile.bad();
+	}
+	contents.resize(size);
+	infile.seekg(0);
+	infile.read(&contents[0], contents.size());
+	return (bool) infile;
+}
+
+// Splits a file's contents into roughly equal chunks of whole lines, one per thread
+static std::vector<std::pair<size_t, size_t>> splitLines(const std::string& contents, int chunks) {
+	std::vector<std::pair<size_t, size_t>> ranges;
+	size_t start = 0;
+	for (int i = 1; i <= chunks && start < contents.size(); i++) {
+		size_t stop = i == chunks ? contents.size() : std::max(start, contents.size() * i / chunks);
+		stop = contents.find('\n', stop);
+		stop = stop == std::string::npos ? contents.size() : stop + 1;
+		ranges.push_back(std::make_pair(start, stop));
+		start = stop;
+	}
+	return ranges;
+}
+
+// Parses the lines of each chunk in parallel, calling parse on every non-empty line, and returns
+// the results of each chunk in file order. Lines that fail to parse are kept, marked invalid
+template <typename T, typename F>
+static std::vector<std::vector<T>> parseParallel(const std::string& contents, int threads, F parse) {
+	auto ranges = splitLines(contents, threads);
+	std::vector<std::vector<T>> results(ranges.size());
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		workers.push_back(std::thread([&, i]() {
+			// Walk the chunk's lines in place, copying only one line at a time
+			std::string line;
+			size_t start = ranges[i].first;
+			while (start < ranges[i].second) {
+				size_t stop = contents.find('\n', start);
+				if (stop == std::string::npos || stop > ranges[i].second)
+					stop = ranges[i].second;
+				line.assign(contents, start, stop - start);
+				start = stop + 1;
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+				if (line.find_first_not_of(" \t") == std::string::npos)
+					continue;
+				T item;
+				parse(line, item);
+				results[i].push_back(item);
+			}
+		}));
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+	return results;
+}
+
+// A line of the post archive before the poster has been given an ID
+struct RawPost {
+	bool valid = false;
+	time_t time = 0;
+	std::string poster;
+	std::string text;
+};
+
+// A line of the edge list
+struct RawEdge {
+	bool valid = false;
+	std::string follower;
+	std::string followed;
+};
+
+// Reads the users file, edge list and post archive into the dump
+static bool readDump(const std::string& users_path, const std::string& edges_path,
+					 const std::string& posts_path, int threads, Dump& dump) {
+	std::string contents;
+
+	if (!users_path.empty()) {
+		if (!readFile(users_path, contents)) {
+			std::cerr << "ERROR: Could not read " << users_path << "\n";
+			return false;
+		}
+		std::istringstream users(contents);
+		std::string username;
+		while (users >> username) {
+			if (validUsername(username))
+				dump.intern(username);
+			else
+				dump.skipped++;
+		}
+	}
+
+	if (!edges_path.empty()) {
+		if (!readFile(edges_path, contents)) {
+			std::cerr << "ERROR: Could not read " << edges_path << "\n";
+			return false;
+		}
+		auto chunks = parseParallel<RawEdge>(contents, threads, [](const std::string& line, RawEdge& edge) {
+			std::istringstream ss(line);
+			edge.valid = (ss >> edge.follower >> edge.followed) && validUsername(edge.follower) && validUsername(edge.followed);
+		});
+
+		// Intern in file order so IDs do not depend on the number of threads
+		for (auto& chunk : chunks) {
+			for (RawEdge& edge : chunk) {
+				if (!edge.valid) {
+					dump.skipped++;
+					continue;
+				}
+				int follower = dump.intern(edge.follower);
+				int followed = dump.intern(edge.followed);
+				dump.followed_users[follower].push_back(followed);
+			}
+		}
+	}
+
+	if (!posts_path.empty()) {
+		if (!readFile(posts_path, contents)) {
+			std::cerr << "ERROR: Could not read " << posts_path << "\n";
+			return false;
+		}
+		auto chunks = parseParallel<RawPost>(contents, threads, [](const std::string& line, RawPost& post) {
+			std::istringstream ss(line);
+			post.valid = (ss >> post.time >> post.poster) && validUsername(post.poster);
+			std::getline(ss >> std::ws, post.text);
+		});
+
+		for (auto& chunk : chunks) {
+			for (RawPost& post : chunk) {
+				if (!post.valid) {
+					dump.skipped++;
+					continue;
+				}
+				dump.posts.push_back(Post(post.time, dump.intern(post.poster), post.text));
+			}
+		}
+	}
+
+	return true;
+}
+
+// Writes a file in one sequential write
+static bool writeFile(const std::string& path, const std::string& contents) {
+	std::ofstream outfile(path, std::ios_base::binary | std::ios_base::trunc);
+	if (!outfile) {
+		std::cerr << "ERROR: Could not write to " << path << "\n";
+		return false;
+	}
+	outfile.write(contents.data(), contents.size());
+	return (bool) outfile;
+}
+
+// Returns the names of the regular files in a directory, which may not exist
+static std::vector<std::string> listFiles(const std::string& dir) {
+	std::vector<std::string> files;
+	DIR* handle = opendir(dir.c_str());
+	if (!handle)
+		return files;
+	while (struct dirent* entry = readdir(handle)) {
+		struct stat info;
+		std::string path = dir + "/" + entry->d_name;
+		if (lstat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+			files.push_back(path);
+	}
+	closedir(handle);
+	return files;
+}
+
+// Writes the users file, then splits the users across threads to write each one's files of followed users and timeline
+static bool writeData(const std::string& dir, int threads, Dump& dump) {
+	mkdir(dir.c_str(), 0755);
+	mkdir((dir + "/users").c_str(), 0755);
+	mkdir((dir + "/timelines").c_str(), 0755);
+
+	std::string users;
+	for (const std::string& username : dump.usernames)
+		users += username + "\n";
+	if (!writeFile(dir + "/users.txt", users))
+		return false;
+
+	// Sort posts by time so every timeline is written oldest first, the order tsd appends them in
+	std::stable_sort(begin(dump.posts), end(dump.posts), [](const Post& a, const Post& b) { return a.time < b.time; });
+	std::vector<std::vector<int>> posts_by(dump.usernames.size());
+	for (int i = 0; i < (int) dump.posts.size(); i++)
+		posts_by[dump.posts[i].poster].push_back(i);
+
+	std::vector<std::thread> workers;
+	std::vector<char> ok(threads, true);
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(std::thread([&, t]() {
+			for (int id = t; id < (int) dump.usernames.size(); id += threads) {
+				// Drop repeated edges, keeping the user's own name first as tsd does
+				std::vector<int>& followed = dump.followed_users[id];
+				std::sort(begin(followed) + 1, end(followed));
+				followed.erase(std::unique(begin(followed) + 1, end(followed)), end(followed));
+				followed.erase(std::remove(begin(followed) + 1, end(followed), id), end(followed));
+
+				std::string contents;
+				for (int user : followed)
+					contents += dump.usernames[user] + "\n";
+				ok[t] = writeFile(dir + "/users/" + dump.usernames[id] + ".txt", contents) && ok[t];
+
+				// Gather the posts of everyone the user follows, including themselves. The file is written
+				// even when there are none, so nothing from an earlier import is left behind
+				std::vector<int> timeline;
+				for (int user : followed)
+					timeline.insert(end(timeline), begin(posts_by[user]), end(posts_by[user]));
+				std::sort(begin(timeline), end(timeline));
+
+				contents.clear();
+				for (int post : timeline) {
+					const Post& p = dump.posts[post];
+					contents += std::to_string(p.time) + " " + dump.usernames[p.poster] + " " + p.text + "\n";
+				}
+				ok[t] = writeFile(dir + "/timelines/" + dump.usernames[id] + ".txt", contents) && ok[t];
+			}
+		}));
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+
+	return std::find(begin(ok), end(ok), false) == end(ok);
+}
+
+int main(int argc, char** argv) {
+	std::string users_path;
+	std::string edges_path;
+	std::string posts_path;
+	std::string dir = "data";
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	bool force = false;
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "u:e:t:d:j:f")) != -1) {
+		switch(opt) {
+		case 'u':
+			users_path = optarg;
+		break;
+		case 'e':
+			edges_path = optarg;
+		break;
+		case 't':
+			posts_path = optarg;
+		break;
+		case 'd':
+			dir = optarg;
+		break;
+		case 'j':
+			threads = std::max(1, atoi(optarg));
+		break;
+		case 'f':
+			force = true;
+		break;
+		default:
+			std::cerr << "Invalid Command Line Argument\n";
+			return 1;
+		}
+	}
+
+	// Refuse to mix a dump into existing server data. With -f, the old users' files are removed once the dump
+	// has been read, since users missing from it would otherwise find their old follows and timeline on login
+	struct stat info;
+	std::vector<std::string> old_files = listFiles(dir + "/users");
+	std::vector<std::string> old_timelines = listFiles(dir + "/timelines");
+	old_files.insert(end(old_files), begin(old_timelines), end(old_timelines));
+	bool existing = stat((dir + "/users.txt").c_str(), &info) == 0 || !old_files.empty();
+	if (existing && !force) {
+		std::cerr << "ERROR: " << dir << " already contains server data, use -f to overwrite it\n";
+		return 1;
+	}
+
+	Dump dump;
+	if (!readDump(users_path, edges_path, posts_path, threads, dump))
+		return 1;
+	for (const std::string& path : old_files) {
+		if (unlink(path.c_str()) != 0) {
+			std::cerr << "ERROR: Could not remove " << path << "\n";
+			return 1;
+		}
+	}
+	if (!writeData(dir, threads, dump))
+		return 1;
+
+	std::cout << "Imported " << dump.usernames.size() << " users and " << dump.posts.size() << " posts into "
+			  << dir << " (skipped " << dump.skipped << " invalid lines)" << std::endl;
+	return 0;
+}
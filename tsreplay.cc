@@ -0,0 +1,423 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "ts.grpc.pb.h"
+#include "trace.h"
+#include "tsd.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::ClientReaderWriter;
+using grpc::Status;
+
+// Replays a trace recorded by tsd against a running server. Calls from each recorded client
+// connection are replayed in order on their own connection, and each timeline on its own stream,
+// so the original concurrency is kept. Each replayed session sends its own session ID, so a trace recorded
+// from the replay keeps them apart even when they share a transport. A timeline starts only once the calls its client made before
+// opening it have completed. Timing is scaled by the replay speed, or ignored at speed 0.
+// The server can be reached over TCP, a Unix domain socket, or run embedded in this process.
+
+// Latencies in microseconds measured during the replay, and those recorded in the trace, per RPC type.
+// Timeline posts are only counted, since the client cannot tell when the server has handled one
+struct Results {
+	std::mutex mtx;
+	std::vector<double> latencies[TRACE_TYPES];
+	std::vector<double> recorded[TRACE_TYPES];
+	int calls[TRACE_TYPES] = {};
+	int errors[TRACE_TYPES] = {};
+
+	void add(int type, double latency, double recorded_latency, bool ok) {
+		std::lock_guard<std::mutex> lock(mtx);
+		latencies[type].push_back(latency);
+		if (recorded_latency > 0)
+			recorded[type].push_back(recorded_latency);
+		count(type, ok);
+	}
+
+	void addUntimed(int type, bool ok) {
+		std::lock_guard<std::mutex> lock(mtx);
+		count(type, ok);
+	}
+
+	private:
+		void count(int type, bool ok) {
+			calls[type]++;
+			if (!ok)
+				errors[type]++;
+		}
+};
+
+// Number of unary calls completed so far in a recorded session, which its timelines wait on
+struct SessionProgress {
+	std::mutex mtx;
+	std::condition_variable changed;
+	size_t completed = 0;
+};
+
+// Summary of a replay that can be saved and compared against a later one
+struct Summary {
+	double throughput = 0;
+	std::map<std::string, std::pair<double, double>> percentiles;   // p50 and p99 by RPC name
+};
+
+// Returns the given percentile of a list of latencies, sorting it in place
+static double percentile(std::vector<double>& values, double p) {
+	if (values.empty())
+		return 0;
+	std::sort(begin(values), end(values));
+	return values[std::min(values.size() - 1, (size_t) (p * values.size()))];
+}
+
+class Replayer {
+	public:
+		Replayer(const std::string& _target, std::shared_ptr<grpc::Server> _embedded, double _speed)
+			: target(_target), embedded(_embedded), speed(_speed), elapsed(0), calls(0),
+			  session_prefix("tsreplay-" + std::to_string(getpid()) + "-" + std::to_string(time(NULL)) + "-") {}
+		void run(const std::vector<TraceRecord>& records);
+		Summary report();
+
+	private:
+		std::shared_ptr<Channel> connect();
+		void waitUntil(uint64_t time_us);
+		Status callUnary(TSN::Stub* stub, const std::string& session_id, const TraceRecord& record);
+		void replaySession(uint32_t session, const std::vector<const TraceRecord*>& calls);
+		void replayStream(uint32_t session, size_t after, const std::vector<const TraceRecord*>& posts);
+
+		std::string target;
+		std::shared_ptr<grpc::Server> embedded;
+		double speed;
+		std::chrono::steady_clock::time_point start;
+		double elapsed;
+		int calls;
+		Results results;
+		std::map<uint32_t, SessionProgress> progress;
+		std::string session_prefix;
+};
+
+std::shared_ptr<Channel> Replayer::connect() {
+	// Give every session its own connection, as separate clients would have
+	grpc::ChannelArguments args;
+	if (embedded)
+		return embedded->InProcessChannel(args);
+	args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+	return grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args);
+}
+
+// Sleeps until the scaled time a recorded request arrived at
+void Replayer::waitUntil(uint64_t time_us) {
+	if (speed <= 0)
+		return;
+	std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t) (time_us / speed)));
+}
+
+// Parses a recorded request and makes the same call as the given session
+template <typename Request, typename Reply, typename F>
+static Status call(const std::string& session_id, const std::string& bytes, F rpc) {
+	Request request;
+	Reply reply;
+	ClientContext context;
+	context.AddMetadata(TRACE_SESSION_KEY, session_id);
+	request.ParseFromString(bytes);
+	return rpc(&context, request, &reply);
+}
+
+Status Replayer::callUnary(TSN::Stub* stub, const std::string& session_id, const TraceRecord& record) {
+	switch (record.header.type) {
+	case TRACE_ADD_USER:
+		return call<UserRequest, UserReply>(session_id, record.message, [&](ClientContext* c, const UserRequest& r, UserReply* p) { return stub->AddUser(c, r, p); });
+	case TRACE_LIST_USERS:
+		return call<ListUsersRequest, ListUsersReply>(session_id, record.message, [&](ClientContext* c, const ListUsersRequest& r, ListUsersReply* p) { return stub->ListUsers(c, r, p); });
+	case TRACE_FOLLOW_USER:
+		return call<FollowUserRequest, UserReply>(session_id, record.message, [&](ClientContext* c, const FollowUserRequest& r, UserReply* p) { return stub->FollowUser(c, r, p); });
+	case TRACE_UNFOLLOW_USER:
+		return call<UnfollowUserRequest, UserReply>(session_id, record.message, [&](ClientContext* c, const UnfollowUserRequest& r, UserReply* p) { return stub->UnfollowUser(c, r, p); });
+	case TRACE_LOOKUP_USERS:
+		return call<LookupUsersRequest, LookupUsersReply>(session_id, record.message, [&](ClientContext* c, const LookupUsersRequest& r, LookupUsersReply* p) { return stub->LookupUsers(c, r, p); });
+	case TRACE_BULK_ADD_USERS:
+		return call<BulkUserRequest, BulkReply>(session_id, record.message, [&](ClientContext* c, const BulkUserRequest& r, BulkReply* p) { return stub->BulkAddUsers(c, r, p); });
+	case TRACE_BULK_FOLLOW:
+		return call<BulkFollowRequest, BulkReply>(session_id, record.message, [&](ClientContext* c, const BulkFollowRequest& r, BulkReply* p) { return stub->BulkFollow(c, r, p); });
+	case TRACE_WHO_TO_FOLLOW:
+		return call<RecommendationRequest, RecommendationReply>(session_id, record.message, [&](ClientContext* c, const RecommendationRequest& r, RecommendationReply* p) { return stub->WhoToFollow(c, r, p); });
+	case TRACE_TOP_USERS:
+		return call<TopUsersRequest, TopUsersReply>(session_id, record.message, [&](ClientContext* c, const TopUsersRequest& r, TopUsersReply* p) { return stub->TopUsers(c, r, p); });
+	case TRACE_SEARCH_POSTS: {
+		// Read every result, since the time to stream them back is part of the call
+		SearchRequest request;
+		ClientContext context;
+		context.AddMetadata(TRACE_SESSION_KEY, session_id);
+		PostMessage p;
+		request.ParseFromString(record.message);
+		std::unique_ptr<grpc::ClientReader<PostMessage>> reader(stub->SearchPosts(&context, request));
+		while (reader->Read(&p)) {}
+		return reader->Finish();
+	}
+	default:
+		return Status(grpc::StatusCode::UNIMPLEMENTED, "Unknown record type");
+	}
+}
+
+// Replays the unary calls of one client connection in order
+void Replayer::replaySession(uint32_t session, const std::vector<const TraceRecord*>& calls) {
+	SessionProgress* progress = &this->progress.at(session);
+	std::string session_id = session_prefix + std::to_string(session);
+	std::unique_ptr<TSN::Stub> stub = TSN::NewStub(connect());
+	for (const TraceRecord* record : calls) {
+		waitUntil(record->header.time_us);
+		auto before = std::chrono::steady_clock::now();
+		Status status = callUnary(stub.get(), session_id, *record);
+		std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - before;
+		results.add(record->header.type, latency.count(), record->header.latency_us, status.ok());
+		
+		std::lock_guard<std::mutex> lock(progress->mtx);
+		progress->completed++;
+		progress->changed.notify_all();
+	}
+}
+
+// Replays one timeline stream, once the first after calls of its session have completed, while
+// draining the posts the server sends back
+void Replayer::replayStream(uint32_t session, size_t after, const std::vector<const TraceRecord*>& posts) {
+	SessionProgress* progress = &this->progress.at(session);
+	{
+		std::unique_lock<std::mutex> lock(progress->mtx);
+		progress->changed.wait(lock, [&]() { return progress->completed >= after; });
+	}
+	
+	std::unique_ptr<TSN::Stub> stub = TSN::NewStub(connect());
+	ClientContext context;
+	context.AddMetadata(TRACE_SESSION_KEY, session_prefix + std::to_string(session));
+	std::shared_ptr<ClientReaderWriter<PostMessage, PostMessage>> stream(stub->ProcessTimeline(&context));
+
+	std::thread reader([stream]() {
+		PostMessage p;
+		while (stream->Read(&p)) {}
+	});
+
+	for (const TraceRecord* record : posts) {
+		PostMessage p;
+		p.ParseFromString(record->message);
+		waitUntil(record->header.time_us);
+		results.addUntimed(TRACE_TIMELINE_POST, stream->Write(p));
+	}
+
+	// The server keeps timelines open indefinitely, so cancel once everything is sent
+	stream->WritesDone();
+	context.TryCancel();
+	reader.join();
+	stream->Finish();
+}
+
+void Replayer::run(const std::vector<TraceRecord>& records) {
+	// Records are written as calls complete, so put them back in arrival order
+	std::vector<const TraceRecord*> sorted;
+	for (const TraceRecord& record : records)
+		sorted.push_back(&record);
+	std::stable_sort(begin(sorted), end(sorted), [](const TraceRecord* a, const TraceRecord* b) {
+		return a->header.time_us < b->header.time_us;
+	});
+
+	std::map<uint32_t, std::vector<const TraceRecord*>> sessions;
+	std::map<uint64_t, std::vector<const TraceRecord*>> streams;
+	for (const TraceRecord* record : sorted) {
+		if (record->header.type == TRACE_TIMELINE_POST)
+			streams[record->header.stream].push_back(record);
+		else if (record->header.type > 0 && record->header.type < TRACE_TYPES)
+			sessions[record->header.session].push_back(record);
+	}
+	calls = sorted.size();
+
+	// Each timeline waits for the calls its session made before the timeline was opened, such as the
+	// AddUser that logged the user in
+	std::vector<size_t> after;
+	for (auto& stream : streams) {
+		auto& earlier = sessions[stream.second.front()->header.session];
+		uint64_t opened = stream.second.front()->header.time_us;
+		after.push_back(std::lower_bound(begin(earlier), end(earlier), opened, [](const TraceRecord* record, uint64_t time) {
+			return record->header.time_us < time;
+		}) - begin(earlier));
+	}
+
+	// Create every session's progress before any thread looks it up
+	for (auto& session : sessions)
+		progress[session.first];
+
+	start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (auto& session : sessions)
+		workers.push_back(std::thread(&Replayer::replaySession, this, session.first, std::cref(session.second)));
+	size_t i = 0;
+	for (auto& stream : streams)
+		workers.push_back(std::thread(&Replayer::replayStream, this, stream.second.front()->header.session,
+									  after[i++], std::cref(stream.second)));
+	for (std::thread& worker : workers)
+		worker.join();
+	elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Prints throughput and latency percentiles for each RPC type, next to the latency tsd recorded.
+// Timeline posts are listed without latencies
+Summary Replayer::report() {
+	Summary summary;
+	summary.throughput = elapsed > 0 ? calls / elapsed : 0;
+
+	std::cout << "Replayed " << calls << " calls in " << std::fixed << std::setprecision(2) << elapsed
+			  << " s (" << summary.throughput << " calls/s)\n";
+	std::cout << std::left << std::setw(14) << "RPC" << std::right << std::setw(8) << "calls" << std::setw(8) << "errors"
+			  << std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(16) << "recorded p50" << "\n";
+	for (int type = 1; type < TRACE_TYPES; type++) {
+		if (results.calls[type] == 0)
+			continue;
+		if (results.latencies[type].empty()) {
+			std::cout << std::left << std::setw(14) << TRACE_NAMES[type] << std::right << std::setw(8) << results.calls[type]
+					  << std::setw(8) << results.errors[type] << std::setw(12) << "-" << std::setw(12) << "-" << std::setw(16) << "-" << "\n";
+			continue;
+		}
+		double p50 = percentile(results.latencies[type], 0.5);
+		double p99 = percentile(results.latencies[type], 0.99);
+		summary.percentiles[TRACE_NAMES[type]] = std::make_pair(p50, p99);
+		std::cout << std::left << std::setw(14) << TRACE_NAMES[type] << std::right << std::setw(8) << results.latencies[type].size()
+				  << std::setw(8) << results.errors[type] << std::setw(12) << p50 << std::setw(12) << p99
+				  << std::setw(16) << percentile(results.recorded[type], 0.5) << "\n";
+	}
+	return summary;
+}
+
+// Saves a summary so a later replay can be compared against it
+static bool saveSummary(const std::string& path, const Summary& summary) {
+	std::ofstream out(path);
+	if (!out)
+		return false;
+	out << "throughput " << summary.throughput << "\n";
+	for (auto& rpc : summary.percentiles)
+		out << rpc.first << " " << rpc.second.first << " " << rpc.second.second << "\n";
+	return true;
+}
+
+static bool loadSummary(const std::string& path, Summary& summary) {
+	std::ifstream in(path);
+	if (!in)
+		return false;
+	std::string name;
+	in >> name >> summary.throughput;
+	double p50, p99;
+	while (in >> name >> p50 >> p99)
+		summary.percentiles[name] = std::make_pair(p50, p99);
+	return true;
+}
+
+// Returns the relative change from a baseline value as a signed percentage
+static std::string change(double baseline, double value) {
+	if (baseline <= 0)
+		return "n/a";
+	std::stringstream ss;
+	ss << std::showpos << std::fixed << std::setprecision(1) << (value - baseline) / baseline * 100 << "%";
+	return ss.str();
+}
+
+// Prints how this replay differs from a saved baseline
+static void compare(const Summary& baseline, const Summary& summary) {
+	std::cout << "\nCompared to baseline:\n";
+	std::cout << std::left << std::setw(14) << "throughput" << std::right << std::setw(12) << change(baseline.throughput, summary.throughput) << "\n";
+	for (auto& rpc : summary.percentiles) {
+		auto base = baseline.percentiles.find(rpc.first);
+		if (base == end(baseline.percentiles))
+			continue;
+		std::cout << std::left << std::setw(14) << rpc.first << std::right
+				  << std::setw(12) << "p50 " + change(base->second.first, rpc.second.first)
+				  << std::setw(14) << "p99 " + change(base->second.second, rpc.second.second) << "\n";
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string trace_path;
+	std::string hostname = "localhost";
+	std::string port = "3010";
+	std::string socket_path;
+	bool embed = false;
+	std::string output_path;
+	std::string baseline_path;
+	double speed = 1;
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "f:h:p:s:ex:o:b:")) != -1) {
+		switch(opt) {
+		case 'f':
+			trace_path = optarg;
+		break;
+		case 'h':
+			hostname = optarg;
+		break;
+		case 'p':
+			port = optarg;
+		break;
+		case 's':
+			socket_path = optarg;
+		break;
+		case 'e':
+			embed = true;
+		break;
+		case 'x':
+			speed = atof(optarg);
+		break;
+		case 'o':
+			output_path = optarg;
+		break;
+		case 'b':
+			baseline_path = optarg;
+		break;
+		default:
+			std::cerr << "Invalid Command Line Argument\n";
+			return 1;
+		}
+	}
+
+	std::vector<TraceRecord> records;
+	if (trace_path.empty() || !readTrace(trace_path, records)) {
+		std::cerr << "ERROR: Could not read trace '" << trace_path << "'\n";
+		return 1;
+	}
+
+	// Run the server in this process if asked, serving the data directory in the current directory
+	std::shared_ptr<grpc::Server> embedded;
+	if (embed) {
+		// Leave the follow graph analytics off so they do not compete with the replay for the CPU
+		ServerOptions options;
+		options.port = "";
+		options.graph_interval = 0;
+		embedded = StartServer(options);
+		if (!embedded) {
+			std::cerr << "ERROR: Could not start the embedded server\n";
+			return 1;
+		}
+	}
+
+	std::string target = socket_path.empty() ? hostname + ":" + port : "unix:" + socket_path;
+	Replayer replayer(target, embedded, speed);
+	replayer.run(records);
+	Summary summary = replayer.report();
+
+	if (!output_path.empty() && !saveSummary(output_path, summary))
+		std::cerr << "ERROR: Could not write to " << output_path << "\n";
+
+	if (!baseline_path.empty()) {
+		Summary baseline;
+		if (loadSummary(baseline_path, baseline))
+			compare(baseline, summary);
+		else
+			std::cerr << "ERROR: Could not read baseline " << baseline_path << "\n";
+	}
+
+	return 0;
+}